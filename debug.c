@@ -1,10 +1,54 @@
 #include "michi.h"
-extern char buf[BUFLEN];
+extern __thread char buf[BUFLEN];
 
 //============================= messages logging ==============================
+// The type of a message is E (error), W (warning), I (information), C (gtp
+// command) or D (debug, removed at compile time with -DNO_DEBUG_LOG). Only
+// the types listed in log_types (option -L) are written in the log file.
+// The log file is buffered: a background thread flushes it every
+// LOG_FLUSH_PERIOD seconds, the errors are flushed at once and the buffer is
+// flushed when the log is closed, so that the search loop does no log I/O.
 FILE    *flog;             // FILE to log messages
+char    *log_types=LOG_TYPES; // types of the messages written in the log
 int     c1,c2;             // counters for warning messages
 int     nmsg;              // number of written log entries
+pthread_t       log_thread;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  log_cond = PTHREAD_COND_INITIALIZER;
+int             log_closing;
+
+void* log_flusher(void *arg)
+{
+    struct timespec t;
+    pthread_mutex_lock(&log_mutex);
+    while (!log_closing) {
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += LOG_FLUSH_PERIOD;
+        pthread_cond_timedwait(&log_cond, &log_mutex, &t);
+        fflush(flog);
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return NULL;
+}
+
+void log_open(const char *filename, int append)
+{
+    flog = fopen(filename, append ? "a" : "w");
+    if (flog == NULL) flog = fopen("/dev/null", "w");
+    setvbuf(flog, NULL, _IOFBF, LOG_BUFFER_SIZE);
+    log_closing = 0;
+    pthread_create(&log_thread, NULL, log_flusher, NULL);
+}
+
+void log_close(void)
+{
+    pthread_mutex_lock(&log_mutex);
+    log_closing = 1;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_mutex);
+    pthread_join(log_thread, NULL);
+    fclose(flog);
+}
 
 void too_many_msg(void)
 // if too many messages have been logged, print a last error and exit
@@ -15,21 +59,29 @@ void too_many_msg(void)
     exit(-1);
 }
 
+int log_enabled(char type)
+{
+    return strchr(log_types, type) != NULL;
+}
+
 void log_fmt_s(char type, const char *msg, const char *s)
 // Log a formatted message (string parameter)
 {
-    fprintf(flog, "%c %5d/%3.3d ", type, c1, c2);
-    fprintf(flog, msg, s); fprintf(flog, "\n");
     if(type == 'E') {
         fprintf(stderr,"%c %5d/%3.3d ", type, c1, c2);
         fprintf(stderr, msg, s); fprintf(stderr,"\n");
     }
+    if (!log_enabled(type)) return;
+    fprintf(flog, "%c %5d/%3.3d ", type, c1, c2);
+    fprintf(flog, msg, s); fprintf(flog, "\n");
+    if (type == 'E') fflush(flog);
     if(nmsg++ > 1000000) too_many_msg();
 }
 
 void log_fmt_i(char type, const char *msg, int n)
 // Log a formatted message (int parameter)
 {
+    if (!log_enabled(type)) return;
     sprintf(buf, msg, n);
     log_fmt_s(type, "%s", buf);
 }
@@ -38,10 +90,60 @@ void log_fmt_p(char type, const char *msg, Point pt)
 // Log a formatted message (point parameter)
 {
     char str[8];
+    if (!log_enabled(type)) return;
     sprintf(buf, msg, str_coord(pt,str));
     log_fmt_s(type,"%s", buf);
 }
 
+//================================ statistics =================================
+char* str_stats(void)
+// Report of the statistics of the search (of the ended threads and of the
+// current one). The time of a phase includes the phases that it calls.
+{
+    static __thread char report[2048];
+    char   line[128];
+    char   *names[ST_NPHASES] = {"simulation", "tree_descend", "expand",
+                      "mcplayout", "tree_update", "fix_atari",
+                      "read_ladder", "large_pattern"};
+    Stats  st = stats_total;
+    stats_add(&st, &stats);
+    double t = st.search_time, sim = st.cycles[ST_SIMUL];
+    unsigned long long nplayouts = st.calls[ST_PLAYOUT];
+
+    sprintf(report, "search time %.2lf s, %llu playouts (%.0lf/s), "
+            "%llu nodes (%.0lf/s)\n", t, nplayouts, t>0 ? nplayouts/t : 0.0,
+            st.nodes, t>0 ? st.nodes/t : 0.0);
+    sprintf(line, "self-atari rejected in playouts: %llu, transpositions: "
+            "%llu, fix_atari memo hits: %llu, %.0lf Mcycles/s\n", st.rejected,
+            st.transpositions, st.atari_memo_hits,
+            t>0 ? st.search_cycles/t*1e-6 : 0.0);
+    strcat(report, line);
+    strcat(report, "phase                calls     Mcycles  cycles/call  "
+                   "%simul");
+    for (int ph=0 ; ph<ST_NPHASES ; ph++) {
+        sprintf(line, "\n%-14s %11llu %11.1lf %12.0lf %7.1lf", names[ph],
+                st.calls[ph], st.cycles[ph]*1e-6,
+                st.calls[ph] ? (double) st.cycles[ph]/st.calls[ph] : 0.0,
+                sim>0 ? 100.0*st.cycles[ph]/sim : 0.0);
+        strcat(report, line);
+    }
+    return report;
+}
+
+void log_stats(void)
+// Write the statistics report in the log file (one entry per line)
+{
+    char *report = str_stats(), *line = report;
+    for (char *p=report ; ; p++)
+        if (*p == '\n' || *p == 0) {
+            int last = (*p == 0);
+            *p = 0;
+            log_fmt_s('I', "%s", line);
+            if (last) break;
+            line = p+1;
+        }
+}
+
 //============================= debug subcommands =============================
 
 char decode_env4(int env4, int pt)
@@ -100,7 +202,8 @@ char* debug(Position *pos)
 {
     char *command = strtok(NULL," \t\n"), *ret="";
     char *known_commands = "\nenv8\nfix_atari\ngen_playout\nmatch_pat3\n"
-                           "match_pat\nplayout\nprint_mark\nsavepos\nsetpos\n";
+                           "match_pat\nplayout\nprint_mark\nsavepos\nsetpos\n"
+                           "stats [reset]\n";
     int  amaf_map[BOARDSIZE], owner_map[BOARDSIZE];
     Info sizes[BOARDSIZE];
     Point moves[BOARDSIZE];
@@ -193,6 +296,15 @@ char* debug(Position *pos)
         print_marker(pos, marker);
         ret = "";
     }
+    else if (strcmp(command, "stats") == 0) {
+        char *str = strtok(NULL, " \t\n");
+        if (str != NULL && strcmp(str, "reset") == 0) {
+            memset(&stats_total, 0, sizeof(Stats));
+            memset(&stats, 0, sizeof(Stats));
+        }
+        else
+            ret = str_stats();
+    }
     else if (strcmp(command, "help") == 0)
         ret = known_commands;
     return ret;
@@ -1,6 +1,50 @@
-int michi_console(int argc, char *argv[]);
+#include "michi.h"
+// The engine is built once for each board size (see Makefile): only its entry
+// point michi_console_<size>() is visible, so that all the board constants are
+// compile time constants in each engine.
+int michi_console_9(int argc, char *argv[], Session *session);
+int michi_console_13(int argc, char *argv[], Session *session);
+int michi_console_19(int argc, char *argv[], Session *session);
 
 int main(int argc, char *argv[])
+// Run the engine of the size given by the option -s (default N_DEFAULT). When
+// the gtp command boardsize asks for another size, the engine returns this
+// size and the gtp session goes on with the engine of this size, with the
+// settings of the session (threads, time, see Session in michi.h).
 {
-    return michi_console(argc, argv);
+    int     size = N_DEFAULT, k, bad = 0;
+    Session session = {0};
+    static char errbuf[1<<16];
+    // the options are scanned as in michi_console()
+    for (k=1 ; k<argc-1 && argv[k][0] == '-' ; k++) {
+        char c;
+        if ((strcmp(argv[k], "-l") == 0 || strcmp(argv[k], "-L") == 0
+                || strcmp(argv[k], "-w") == 0) && k+1 < argc-1)
+            k++;                            // argument of the option
+        else if (strncmp(argv[k], "-s", 2) == 0
+                && sscanf(argv[k], "-s%d%c", &size, &c) != 1)
+            bad = k;
+    }
+    // The gtp diagnostics are written on stderr once the reply has been sent
+    // (gtp_io() flushes stderr after each reply). The buffer of stderr must
+    // be set before any output.
+    if (k < argc && strcmp(argv[k], "gtp") == 0)
+        setvbuf(stderr, errbuf, _IOFBF, sizeof(errbuf));
+    if (bad) {
+        fprintf(stderr, "bad option %s (-s SIZE, SIZE in " BOARD_SIZES ")\n",
+                                                                   argv[bad]);
+        return -1;
+    }
+    while (size != 0) {
+        switch (size) {
+            case 9:  size = michi_console_9(argc, argv, &session);  break;
+            case 13: size = michi_console_13(argc, argv, &session); break;
+            case 19: size = michi_console_19(argc, argv, &session); break;
+            default:
+                fprintf(stderr, "board size %d is not in " BOARD_SIZES "\n",
+                                                                        size);
+                return -1;
+        }
+    }
+    return 0;
 }
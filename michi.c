@@ -85,12 +85,32 @@ Short bibliography
     and historical bibliography
 */
 #include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include "michi.h"
 
 void usage() {
-    fprintf(stderr, "\n\nusage: michi [-z SEED] [command]\n\n"
-                    "where  command = gtp|mcdebug|mcbenchmark|tsdebug\n"
-                    "       SEED    = > 0 (fixed seed) or 0 (random seed)\n");
+    fprintf(stderr, "\n\nusage: michi [-s SIZE] [-z SEED] [-t THREADS] [-k K] "
+                    "[-m MB] [-p] [-l LOGFILE] [-L TYPES] [-w CMD]... "
+                    "[command]\n\n"
+                    "where  command = gtp|mcdebug|mcbenchmark|tsdebug|\n"
+                    "                 compile_patterns|benchmark FILE|\n"
+                    "                 selfplay NGAMES FILE\n"
+                    "       SIZE    = board size (" BOARD_SIZES ")\n"
+                    "       SEED    = > 0 (fixed seed) or 0 (random seed)\n"
+                    "       THREADS = number of threads of the tree search\n"
+                    "       K       = playouts run from each leaf of the tree\n"
+                    "       MB      = size of the transposition table "
+                    "(0: no table)\n"
+                    "       -p      : search on the opponent time (gtp)\n"
+                    "       LOGFILE = log file (default michi.log)\n"
+                    "       TYPES   = types of the logged messages among "
+                    "EWICD\n"
+                    "                 (default " LOG_TYPES ")\n"
+                    "       CMD     = command starting a worker process of the\n"
+                    "                 search (ex: \"./michi -l w1.log gtp\")\n");
     exit(-1);
 }
 
@@ -104,11 +124,23 @@ void usage() {
 //                      North East South  West  NE  SE  SW  NW
 static int   delta[] = { -N-1,   1,  N+1,   -1, -N,  W,  N, -W, 0};
 static char* colstr  = "@ABCDEFGHJKLMNOPQRST";
-Mark         *mark1, *mark2, *already_suggested;
-unsigned int idum=1;
-char         buf[BUFLEN];
+int          nthreads=1;
+int          leaf_playouts=1;       // playouts run from each leaf (option -k)
+// private data of each thread
+__thread Mark *mark1, *mark2, *already_suggested;
+__thread Rng rng;
+__thread LadderFrame *ladder_frames;   // stack of frames of fix_atari() calls
+__thread int ladder_depth;             // number of frames in use
+__thread AtariMemo *atari_memo;        // memo of fix_atari() (ATARI_MEMO_SIZE)
+__thread char buf[BUFLEN];
+__thread Journal *journal;
+__thread Stats stats;
+Stats        stats_total;           // statistics of the threads that ended
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 Point        allpoints[BOARDSIZE];
 int          PRIOR_CFG[] =     {24, 22, 8};
+// Zobrist data of the positions: stones (BLACK=0, WHITE=1), ko, WHITE to play
+ZobristHash  zobrist_stone[2][BOARDSIZE], zobrist_ko[BOARDSIZE], zobrist_white;
 
 //================================== Code =====================================
 // Utilities
@@ -131,6 +163,65 @@ char* slist_str_as_point(Slist l) {
     return buf;
 }
 
+void rng_seed(Rng *r, unsigned long long seed)
+// Set the state of the random generator r from seed
+{
+    for (int k=0 ; k<4 ; k++) r->s[k] = splitmix64(&seed);
+}
+
+void rng_jump(Rng *r)
+// Advance r by 2^128 numbers: the sequences drawn from successive jumps of a
+// state do not overlap (the threads of a search get such streams)
+{
+    static const unsigned long long jump[4] = {0x180ec6d33cfd0abaULL,
+            0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+    unsigned long long s[4] = {0, 0, 0, 0};
+    for (int i=0 ; i<4 ; i++)
+        for (int b=0 ; b<64 ; b++) {
+            if (jump[i] & (1ULL << b))
+                for (int k=0 ; k<4 ; k++) s[k] ^= r->s[k];
+            rng_next(r);
+        }
+    for (int k=0 ; k<4 ; k++) r->s[k] = s[k];
+}
+
+void thread_init(Rng *r)
+// Allocate the data private to the current thread and set its random generator
+{
+    already_suggested = calloc(1, sizeof(Mark));
+    mark1 = calloc(1, sizeof(Mark)); mark2 = calloc(1, sizeof(Mark));
+    journal = calloc(1, sizeof(Journal));
+    ladder_frames = malloc(MAX_LADDER_DEPTH*sizeof(LadderFrame));
+    atari_memo = calloc(ATARI_MEMO_SIZE, sizeof(AtariMemo));
+    init_large_board();
+    rng = *r;
+}
+
+void stats_add(Stats *sum, Stats *st)
+// Add the statistics st to sum
+{
+    for (int ph=0 ; ph<ST_NPHASES ; ph++) {
+        sum->calls[ph] += st->calls[ph];
+        sum->cycles[ph] += st->cycles[ph];
+    }
+    sum->rejected += st->rejected;
+    sum->nodes += st->nodes;
+    sum->transpositions += st->transpositions;
+    sum->atari_memo_hits += st->atari_memo_hits;
+    sum->search_cycles += st->search_cycles;
+    sum->search_time += st->search_time;
+}
+
+void thread_free(void)
+{
+    free(already_suggested); free(mark1); free(mark2); free(journal);
+    free(ladder_frames); free(atari_memo);
+    pthread_mutex_lock(&stats_mutex);
+    stats_add(&stats_total, &stats);
+    pthread_mutex_unlock(&stats_mutex);
+    memset(&stats, 0, sizeof(stats));
+}
+
 unsigned int true_random_seed(void)
 // return a true random seed (which depends on the time)
 {
@@ -140,7 +231,7 @@ unsigned int true_random_seed(void)
     sec  = tcal->tm_sec + 60*(tcal->tm_min + 60*tcal->tm_hour);
     // day is a coarse (but sufficient for the current purpose) approximation
     day = tcal->tm_mday + 31*(tcal->tm_mon + 12*tcal->tm_year);
-    // Park & Miller random generator (same as qdrandom())
+    // Park & Miller random generator (the LCG of the first versions of michi)
     r1 =  (1664525*sec) + 1013904223;
     r2 = (1664525*day) + 1013904223;
     return (r1^r2);
@@ -191,6 +282,47 @@ char is_eye(Position *pos, Point pt)
     return eyecolor;
 }
 
+Bitboard eyeish_points(Position *pos, Bitboard *stones)
+// Word-parallel is_eyeish() for all the points : return the set of the empty
+// points whose 4 neighbors are stones of the set stones or out of board
+{
+    Bitboard b, eyes;
+    for (int k=0 ; k<BB_WORDS ; k++)       // stones or out of board points
+        b.w[k] = stones->w[k] | ~(pos->bb_X.w[k] | pos->bb_x.w[k]
+                                                  | pos->bb_empty.w[k]);
+    Bitboard n1=bb_shift_up(b, N+1), n2=bb_shift_down(b, N+1);
+    Bitboard n3=bb_shift_up(b, 1), n4=bb_shift_down(b, 1);
+    for (int k=0 ; k<BB_WORDS ; k++)
+        eyes.w[k] = pos->bb_empty.w[k] & n1.w[k] & n2.w[k] & n3.w[k] & n4.w[k];
+    return eyes;
+}
+
+Bitboard true_eyes(Position *pos)
+// Word-parallel is_eye() for all the points : return the set of the eyes of
+// the player to play ('X')
+{
+    Bitboard eyes=eyeish_points(pos, &pos->bb_X), out, d[4], o[4];
+    for (int k=0 ; k<BB_WORDS ; k++)
+        out.w[k] = ~(pos->bb_X.w[k] | pos->bb_x.w[k] | pos->bb_empty.w[k]);
+    // 'x' stones and out of board points on the 4 diagonals
+    d[0] = bb_shift_up(pos->bb_x, N); d[1] = bb_shift_down(pos->bb_x, N);
+    d[2] = bb_shift_up(pos->bb_x, W); d[3] = bb_shift_down(pos->bb_x, W);
+    o[0] = bb_shift_up(out, N);       o[1] = bb_shift_down(out, N);
+    o[2] = bb_shift_up(out, W);       o[3] = bb_shift_down(out, W);
+    for (int k=0 ; k<BB_WORDS ; k++) {
+        // count the falsifying diagonals (one bit adder : ones + 2*twos)
+        unsigned long long ones=0, twos=0, edge=0;
+        for (int i=0 ; i<4 ; i++) {
+            twos |= ones & d[i].w[k];
+            ones ^= d[i].w[k];
+            edge |= o[i].w[k];
+        }
+        // false eye if 2 falsifying diagonals or 1 at the edge of the board
+        eyes.w[k] &= ~twos & ~(edge & (ones | twos));
+    }
+    return eyes;
+}
+
 Byte compute_env4(Position *pos, Point pt, int offset)
 // Compute value of the environnement of a point (Byte)
 // offset=0 for the 4 neighbors, offset=4 for the 4 diagonal neighbors
@@ -218,9 +350,90 @@ Byte compute_env4(Position *pos, Point pt, int offset)
     return env4;
 }
 
+void save_block_data(Position *pos, Point b)
+{
+    JSAVE(pos, pos->plibs[b]);
+    JSAVE(pos, pos->libsum[b]);
+    JSAVE(pos, pos->libsum2[b]);
+}
+
+void save_env4(Position *pos, Point pt)
+// Save the env4 and env4d of the 8 neighbors of pt
+{
+    JSAVE(pos, pos->env4[pt+N+1]); JSAVE(pos, pos->env4[pt-1]);
+    JSAVE(pos, pos->env4[pt-N-1]); JSAVE(pos, pos->env4[pt+1]);
+    JSAVE(pos, pos->env4d[pt+N]);  JSAVE(pos, pos->env4d[pt-W]);
+    JSAVE(pos, pos->env4d[pt-N]);  JSAVE(pos, pos->env4d[pt+W]);
+}
+
+void add_pseudo_lib(Position *pos, Point b, Point lib)
+// Add one pseudo liberty to the block of head b
+{
+    save_block_data(pos, b);
+    pos->plibs[b]++;
+    pos->libsum[b]  += lib;
+    pos->libsum2[b] += lib*lib;
+}
+
+void remove_pseudo_lib(Position *pos, Point b, Point lib)
+// Remove one pseudo liberty from the block of head b
+{
+    save_block_data(pos, b);
+    pos->plibs[b]--;
+    pos->libsum[b]  -= lib;
+    pos->libsum2[b] -= lib*lib;
+}
+
+int block_in_atari(Position *pos, Point b)
+// Return 1 if the block of head b has only one liberty (i.e. all its pseudo
+// liberties are the same point). The block must have at least one liberty
+{
+    unsigned long long n=pos->plibs[b], s=pos->libsum[b], s2=pos->libsum2[b];
+    return n*s2 == s*s;
+}
+
+Point atari_lib(Position *pos, Point b)
+// Return the liberty of the block of head b (that must be in atari)
+{
+    return pos->libsum[b] / pos->plibs[b];
+}
+
+void merge_blocks(Position *pos, Point b1, Point b2)
+// Merge the block of head b2 into the block of head b1
+{
+    Point pt = b2;
+    do {
+        JSAVE(pos, pos->block[pt]);
+        pos->block[pt] = b1;
+        pt = pos->next[pt];
+    } while (pt != b2);
+    JSAVE(pos, pos->next[b1]); JSAVE(pos, pos->next[b2]);
+    SWAP(unsigned short, pos->next[b1], pos->next[b2]); // join the 2 lists
+    save_block_data(pos, b1);
+    pos->plibs[b1]   += pos->plibs[b2];
+    pos->libsum[b1]  += pos->libsum[b2];
+    pos->libsum2[b1] += pos->libsum2[b2];
+}
+
+__INLINE__ void update_pat3(Position *pos, Point pt)
+// Update bb_pat3 at pt and at its 8 neighbors, whose env4 or env4d have been
+// changed by the stone put or removed at pt (bb_pat3 is saved once per move)
+{
+    const int d[9] = {0, 1, -1, N+1, -N-1, N, -N, W, -W};
+    for (int k=0 ; k<9 ; k++) {
+        Point n = pt + d[k];
+        unsigned long long match = (pos->color[n] == '.') & pat3_match(pos, n);
+        unsigned long long *w = &pos->bb_pat3.w[n>>6];
+        *w = (*w & ~(1ULL << (n&63))) | (match << (n&63));
+    }
+}
+
 void put_stone(Position *pos, Point pt)
 // Always put a stone of color 'X'. See discussion on env4 in patterns.c
 {
+    int   k;
+    Point n;
+    save_env4(pos, pt);
     if (pos->n%2 == 0) {  // BLACK to play (X=BLACK)
         pos->env4[pt+N+1] ^= 0x11;
         pos->env4[pt-1]   ^= 0x22;
@@ -241,12 +454,43 @@ void put_stone(Position *pos, Point pt)
         pos->env4d[pt-N]  &= 0xBB;
         pos->env4d[pt+W]  &= 0x77;
     }
+    JSAVE(pos, pos->color[pt]);
     pos->color[pt] = 'X';
+    update_pat3(pos, pt);
+    pos->hash ^= zobrist_stone[pos->n%2][pt];   // saved once per move (journal)
+    JSAVE(pos, pos->bb_X.w[pt>>6]); JSAVE(pos, pos->bb_empty.w[pt>>6]);
+    bb_set(&pos->bb_X, pt); bb_clear(&pos->bb_empty, pt);
+    Point last = pos->empty[pos->nempty-1];     // remove pt from the empty set
+    JSAVE(pos, pos->nempty); JSAVE(pos, pos->empty[pos->empty_idx[pt]]);
+    JSAVE(pos, pos->empty_idx[last]);
+    pos->nempty--;
+    pos->empty[pos->empty_idx[pt]] = last;
+    pos->empty_idx[last] = pos->empty_idx[pt];
+
+    // Update the blocks: pt is first a new block of one stone
+    JSAVE(pos, pos->block[pt]); JSAVE(pos, pos->next[pt]);
+    save_block_data(pos, pt);
+    pos->block[pt] = pos->next[pt] = pt;
+    pos->plibs[pt] = pos->libsum[pt] = pos->libsum2[pt] = 0;
+    FORALL_NEIGHBORS(pos, pt, k, n) {
+        char c = pos->color[n];
+        if (c == '.')      add_pseudo_lib(pos, pt, n);
+        else if (c != ' ') remove_pseudo_lib(pos, pos->block[n], pt);
+    }
+    // then it is merged with the neighbor blocks of the same color
+    FORALL_NEIGHBORS(pos, pt, k, n) {
+        if (pos->color[n] != 'X' || pos->block[n] == pos->block[pt]) continue;
+        if (pos->block[pt] == pt) merge_blocks(pos, pos->block[n], pt);
+        else                      merge_blocks(pos, pos->block[pt], pos->block[n]);
+    }
 }
 
 void remove_stone(Position *pos, Point pt)
-// Always remove a stone of color 'x' (cheat done by caller when undo move)
+// Always remove a stone of color 'x'
 {
+    int   k;
+    Point n;
+    save_env4(pos, pt);
     if (pos->n%2 == 0) {  // BLACK to play (x=WHITE)
         pos->env4[pt+N+1] |= 0x10;
         pos->env4[pt-1]   |= 0x20;
@@ -267,7 +511,23 @@ void remove_stone(Position *pos, Point pt)
         pos->env4d[pt-N]  ^= 0x44;
         pos->env4d[pt+W]  ^= 0x88;
     }
+    JSAVE(pos, pos->color[pt]);
     pos->color[pt] = '.';
+    update_pat3(pos, pt);
+    pos->hash ^= zobrist_stone[(pos->n+1)%2][pt];
+    JSAVE(pos, pos->bb_x.w[pt>>6]); JSAVE(pos, pos->bb_empty.w[pt>>6]);
+    bb_clear(&pos->bb_x, pt); bb_set(&pos->bb_empty, pt);
+    JSAVE(pos, pos->empty_idx[pt]); JSAVE(pos, pos->empty[pos->nempty]);
+    JSAVE(pos, pos->nempty);
+    pos->empty_idx[pt] = pos->nempty;           // add pt to the empty set
+    pos->empty[pos->nempty++] = pt;
+
+    // Update the blocks (pt is a new liberty of the neighbor blocks)
+    JSAVE(pos, pos->block[pt]);
+    pos->block[pt] = 0;
+    FORALL_NEIGHBORS(pos, pt, k, n)
+        if (pos->color[n] == 'X' || pos->color[n] == 'x')
+            add_pseudo_lib(pos, pos->block[n], pt);
 }
 
 void dump_env4(Byte env4, Byte true_env4)
@@ -310,6 +570,80 @@ int env4_OK(Position *pos)
     return 1;
 }
 
+int blocks_OK(Position *pos)
+// Check the incrementally updated blocks (and bitboards) against a direct
+// computation
+{
+    int   k, nstones[BOARDSIZE];
+    Point n;
+    ZobristHash hash = 0;
+    memset(nstones, 0, sizeof(nstones));
+    FORALL_POINTS(pos, pt) {
+        char c = pos->color[pt];
+        if (c == 'X' || c == 'x')     // 'X' is BLACK if pos->n is even
+            hash ^= zobrist_stone[(pos->n + (c == 'x'))%2][pt];
+        if (bb_is_set(&pos->bb_X, pt) != (c == 'X')
+                || bb_is_set(&pos->bb_x, pt) != (c == 'x')
+                || bb_is_set(&pos->bb_empty, pt) != (c == '.')
+                || bb_is_set(&pos->bb_pat3, pt) != (c == '.'
+                                                 && pat3_match(pos, pt)))
+            goto error;
+        if (c == '.' && pos->empty[pos->empty_idx[pt]] != pt) goto error;
+        if (c != 'X' && c != 'x') continue;
+        Point b = pos->block[pt];
+        if (pos->block[b] != b || pos->color[b] != c) goto error;
+        nstones[b]++;
+        FORALL_NEIGHBORS(pos, pt, k, n)
+            if (pos->color[n] == c && pos->block[n] != b) goto error;
+    }
+    FORALL_POINTS(pos, b) {
+        if (nstones[b] == 0) continue;
+        unsigned int plibs=0, libsum=0, libsum2=0, len=0;
+        Point pt = b;
+        do {
+            if (pos->block[pt] != b || ++len > nstones[b]) goto error;
+            FORALL_NEIGHBORS(pos, pt, k, n)
+                if (pos->color[n] == '.') {
+                    plibs++; libsum += n; libsum2 += n*n;
+                }
+            pt = pos->next[pt];
+        } while (pt != b);
+        if (len != nstones[b] || plibs != pos->plibs[b]
+                || libsum != pos->libsum[b] || libsum2 != pos->libsum2[b])
+            goto error;
+    }
+    if (pos->nempty != bb_count(&pos->bb_empty) || hash != pos->hash)
+        goto error;
+    return 1;
+error:
+    fprintf(stderr, "ERR blocks\n");
+    return 0;
+}
+
+void init_zobrist_board(void)
+// Draw the Zobrist data of the positions. A private generator (splitmix64) is
+// used, it does not change the sequence of the random numbers of the search.
+{
+    ZobristHash x = 0x4d494348495a4f42ULL;
+    ZobristHash *keys[3] = {zobrist_stone[0], zobrist_stone[1], zobrist_ko};
+    for (int t=0 ; t<=3 ; t++)
+        for (int pt=0 ; pt<(t<3 ? BOARDSIZE : 1) ; pt++) {
+            ZobristHash z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            if (t < 3) keys[t][pt] = z;
+            else       zobrist_white = z;
+        }
+    zobrist_ko[0] = 0;                          // no ko
+}
+
+ZobristHash position_key(Position *pos)
+// Zobrist key of the position: stones, ko and player to play
+{
+    return pos->hash ^ zobrist_ko[pos->ko] ^ (pos->n%2 ? zobrist_white : 0);
+}
+
 char* empty_position(Position *pos)
 // Reset pos to an initial board position
 {
@@ -325,9 +659,23 @@ char* empty_position(Position *pos)
         pos->env4[pt] = compute_env4(pos, pt, 0);
         pos->env4d[pt] = compute_env4(pos, pt, 4);
     }
+    memset(pos->block, 0, sizeof(pos->block));
+    memset(&pos->bb_X, 0, sizeof(Bitboard));
+    memset(&pos->bb_x, 0, sizeof(Bitboard));
+    memset(&pos->bb_empty, 0, sizeof(Bitboard));
+    memset(&pos->bb_pat3, 0, sizeof(Bitboard));
+    pos->nempty = 0;
+    FORALL_POINTS(pos, pt)
+        if (pos->color[pt] == '.') {
+            bb_set(&pos->bb_empty, pt);
+            if (pat3_match(pos, pt)) bb_set(&pos->bb_pat3, pt);
+            pos->empty_idx[pt] = pos->nempty;
+            pos->empty[pos->nempty++] = pt;
+        }
 
     pos->ko = pos->last = pos->last2 = 0;
     pos->capX = pos->cap = 0;
+    pos->hash = 0;
     pos->n = 0; pos->komi = 7.5;
     assert(env4_OK(pos));
     return "";              // result OK
@@ -335,86 +683,100 @@ char* empty_position(Position *pos)
 
 void compute_block(Position *pos, Point pt, Slist stones, Slist libs, int nlibs)
 // Compute block at pt : list of stones and list of liberties
-// Return early when nlibs liberties are found
+// Stop looking for liberties when nlibs liberties are found
 {
-    char  color=pos->color[pt];
-    int   head=2, k, tail=1;
-    Point n;
-
-    mark_init(mark1); slist_clear(libs);
-    stones[1] = pt; mark(mark1, pt);
-    while(head>tail) {
-        pt = stones[tail++];
-        FORALL_NEIGHBORS(pos, pt, k, n)
-            if (!is_marked(mark1, n)) {
-                mark(mark1, n);
-                if (pos->color[n] == color)    stones[head++] = n;
-                else if (pos->color[n] == '.') {
+    int   k;
+    Point n, st=pt;
+
+    mark_init(mark1); slist_clear(stones); slist_clear(libs);
+    do {
+        slist_push(stones, st);
+        if (slist_size(libs) < nlibs)
+            FORALL_NEIGHBORS(pos, st, k, n)
+                if (pos->color[n] == '.' && !is_marked(mark1, n)) {
+                    mark(mark1, n);
                     slist_push(libs, n);
-                    if (slist_size(libs) >= nlibs) goto finished;
+                    if (slist_size(libs) >= nlibs) break;
                 }
-            }
-    }
-finished:
-    stones[0] = head-1;
+        st = pos->next[st];
+    } while (st != pt);
     mark_release(mark1);
 }
 
-int capture_block(Position *pos, Slist stones)
+int capture_block(Position *pos, Point pt)
+// Remove all the stones of the block containing pt, return their number
 {
-    FORALL_IN_SLIST(stones, pt) remove_stone(pos, pt);
+    int   n=0;
+    Point st=pt;
+    do {
+        remove_stone(pos, st);      // remove_stone() does not modify next[]
+        st = pos->next[st]; n++;
+    } while (st != pt);
     assert(env4_OK(pos));
-    return slist_size(stones);
+    return n;
 }
 
 void swap_color(Position *pos)
+// SWAP_CASE of all the stones. The color string is processed by words of 8
+// chars: the stones are the chars c such that (c | 0x20) == 'x' and their case
+// is swapped by flipping their bit 0x20
 {
-    FORALL_POINTS(pos, pt)
-        SWAP_CASE(pos->color[pt]);
+    const unsigned long long lo7=0x7F7F7F7F7F7F7F7FULL;
+    unsigned long long w, t;
+    int k;
+    for (k=0 ; k+8<=BOARDSIZE ; k+=8) {
+        memcpy(&w, pos->color+k, 8);
+        t = (w | 0x2020202020202020ULL) ^ 0x7878787878787878ULL;
+        t = ~(((t & lo7) + lo7) | t | lo7);     // 0x80 in the bytes of stones
+        w ^= t >> 2;
+        memcpy(pos->color+k, &w, 8);
+    }
+    for ( ; k<BOARDSIZE ; k++)
+        SWAP_CASE(pos->color[k]);
+    SWAP(Bitboard, pos->bb_X, pos->bb_x);
 }
 
-void remove_X_stone(Position *pos, Point pt)
+int is_suicide(Position *pos, Point pt)
+// Test if playing at the EMPTY point pt would be a suicide
 {
-    (pos->n)++;             // cheat to make remove_stone() work
-    remove_stone(pos, pt);
-    (pos->n)--;             // undo cheat
+    int   k;
+    Point n;
+    FORALL_NEIGHBORS(pos, pt, k, n) {
+        char c = pos->color[n];
+        if (c == '.') return 0;
+        if (c == ' ') continue;
+        int in_atari = block_in_atari(pos, pos->block[n]);
+        if (c == 'x' && in_atari)  return 0;     // capture of the block
+        if (c == 'X' && !in_atari) return 0;     // block has another liberty
+    }
+    return 1;
 }
 
 char* play_move(Position *pos, Point pt)
 // Play a move at point pt (color is imposed by alternate play)
 {
     int   captured=0, k;
-    Point libs[BOARDSIZE], n, stones[BOARDSIZE], pos_capture;
+    Point n, pos_capture;
 
     pos->ko_old = pos->ko;
     if (pt == pos->ko) return "Error Illegal move: retakes ko";
+    if (is_suicide(pos, pt)) return "Error Illegal move: suicide";
     int in_enemy_eye = is_eyeish(pos, pt);
 
     put_stone(pos, pt);
     // Check for captures
     pos_capture = 0;
     FORALL_NEIGHBORS(pos, pt, k, n) {
-        if (pos->color[n] != 'x') continue;
-        compute_block(pos,n,stones, libs, 1);                // extremely naive
-        if (slist_size(libs)==0) {
-            captured += capture_block(pos, stones);
-            pos_capture = n;
-        }
-
+        if (pos->color[n] != 'x' || pos->plibs[pos->block[n]] != 0) continue;
+        captured += capture_block(pos, n);
+        pos_capture = n;
     }
     if (captured) { // Set ko
         if (captured==1 && in_enemy_eye) pos->ko = pos_capture;
         else                             pos->ko = 0;
     }
-    else { // Test for suicide
+    else
         pos->ko = 0;
-        compute_block(pos, pt, stones, libs, 1);
-        if(slist_size(libs) == 0) {
-            pos->ko = pos->ko_old;
-            remove_X_stone(pos, pt);
-            return "Error Illegal move: suicide";
-        }
-    }
     // Finish update of the position
     captured += pos->capX;
     pos->capX = pos->cap;
@@ -422,6 +784,7 @@ char* play_move(Position *pos, Point pt)
     swap_color(pos);
     (pos->n)++;
     assert(env4_OK(pos));
+    assert(blocks_OK(pos));
     pos->last2 = pos->last;
     pos->last  = pt;
     return "";          // Move OK
@@ -437,6 +800,81 @@ char* pass_move(Position *pos)
     return "";          // PASS moVE is always OK
 }
 
+char* play_move_undoable(Position *pos, Point pt)
+// Same as play_move() but the move can be undone by undo_move() (or kept by
+// keep_move()) if it is legal. The moves can be nested (LIFO order) and the
+// position must not be modified by other means until the move is undone.
+// The move is refused (as an illegal move) if the journal could overflow.
+{
+    Journal *j = journal;
+    int top = j->n1;
+    if (j->n2 > top) top = j->n2;
+    if (j->n4 > top) top = j->n4;
+    if (j->n8 > top) top = j->n8;
+    if (j->nmoves >= MAX_UNDO || top > JOURNAL_SIZE - JOURNAL_MOVE_MAX) {
+        log_fmt_s('W', "journal full: undoable move refused", NULL);
+        return "Error journal full";
+    }
+    int k = j->nmoves++;
+    j->move[k].n1 = j->n1;        j->move[k].n2 = j->n2;
+    j->move[k].n4 = j->n4;        j->move[k].n8 = j->n8;
+    j->move[k].prev = j->pos;
+    j->move[k].ko = pos->ko;      j->move[k].ko_old = pos->ko_old;
+    j->move[k].last = pos->last;  j->move[k].last2 = pos->last2;
+    j->move[k].n = pos->n;
+    j->move[k].cap = pos->cap;    j->move[k].capX = pos->capX;
+    j->move[k].hash = pos->hash;  j->move[k].bb_pat3 = pos->bb_pat3;
+    j->pos = pos;
+    char *ret = play_move(pos, pt);
+    assert(j->n1 - j->move[k].n1 <= JOURNAL_MOVE_MAX
+           && j->n2 - j->move[k].n2 <= JOURNAL_MOVE_MAX
+           && j->n4 - j->move[k].n4 <= JOURNAL_MOVE_MAX
+           && j->n8 - j->move[k].n8 <= JOURNAL_MOVE_MAX);
+    if (ret[0] != 0) {            // illegal move: pos is unchanged
+        pos->ko_old = j->move[k].ko_old;
+        j->pos = j->move[k].prev; j->nmoves--;
+    }
+    return ret;
+}
+
+void undo_move(Position *pos)
+// Undo the last move played by play_move_undoable()
+{
+    Journal *j = journal;
+    int k = --j->nmoves;
+    assert(k >= 0 && j->pos == pos);
+    swap_color(pos);
+    char *p = (char *) pos;
+    for (int i=j->n1-1 ; i>=j->move[k].n1 ; i--)
+        *(Byte *) (p + j->e1[i].off) = j->e1[i].old;
+    for (int i=j->n2-1 ; i>=j->move[k].n2 ; i--)
+        *(unsigned short *) (p + j->e2[i].off) = j->e2[i].old;
+    for (int i=j->n4-1 ; i>=j->move[k].n4 ; i--)
+        *(unsigned int *) (p + j->e4[i].off) = j->e4[i].old;
+    for (int i=j->n8-1 ; i>=j->move[k].n8 ; i--)
+        *(unsigned long long *) (p + j->e8[i].off) = j->e8[i].old;
+    j->n1 = j->move[k].n1; j->n2 = j->move[k].n2;
+    j->n4 = j->move[k].n4; j->n8 = j->move[k].n8;
+    pos->ko = j->move[k].ko;      pos->ko_old = j->move[k].ko_old;
+    pos->last = j->move[k].last;  pos->last2 = j->move[k].last2;
+    pos->n = j->move[k].n;
+    pos->cap = j->move[k].cap;    pos->capX = j->move[k].capX;
+    pos->hash = j->move[k].hash;  pos->bb_pat3 = j->move[k].bb_pat3;
+    j->pos = j->move[k].prev;
+}
+
+void keep_move(Position *pos)
+// Forget the last move played by play_move_undoable() (it cannot be undone
+// any more). It must not be nested in another move of the same position.
+{
+    Journal *j = journal;
+    int k = --j->nmoves;
+    assert(k >= 0 && j->pos == pos && j->move[k].prev != pos);
+    j->n1 = j->move[k].n1; j->n2 = j->move[k].n2;
+    j->n4 = j->move[k].n4; j->n8 = j->move[k].n8;
+    j->pos = j->move[k].prev;
+}
+
 void make_list_neighbors(Position *pos, Point pt, Slist points)
 {
     slist_clear(points);
@@ -465,8 +903,8 @@ void make_list_neighbor_blocks_in_atari(Position *pos, Slist stones,
 // Each block in the list is represented by one of its points brep
 {
     char  color = pos->color[stones[1]];
-    int   k, maxlibs=2;
-    Point n, st[BOARDSIZE], l[4];
+    int   k;
+    Point n;
 
     if (color == 'x') color = 'X';
     else              color = 'x';
@@ -474,13 +912,12 @@ void make_list_neighbor_blocks_in_atari(Position *pos, Slist stones,
     mark_init(mark2); slist_clear(breps); slist_clear(libs);
     FORALL_IN_SLIST(stones, pt) {
         FORALL_NEIGHBORS(pos, pt, k, n) {
-            if (pos->color[n] == color && !is_marked(mark2, n)) {
-                compute_block(pos, n, st, l, maxlibs);
-                if (slist_size(l) == 1) {
-                    slist_push(breps, st[1]);
-                    slist_push(libs, l[1]);
-                    FORALL_IN_SLIST(st, p)
-                        mark(mark2, p);
+            Point b = pos->block[n];
+            if (pos->color[n] == color && !is_marked(mark2, b)) {
+                mark(mark2, b);           // the block is looked at only once
+                if (block_in_atari(pos, b)) {
+                    slist_push(breps, n);
+                    slist_push(libs, atari_lib(pos, b));
                 }
             }
         }
@@ -488,28 +925,35 @@ void make_list_neighbor_blocks_in_atari(Position *pos, Slist stones,
     mark_release(mark2);
 }
 
-double score(Position *pos, int owner_map[])
-// compute score for to-play player; this assumes a final position with all
-// dead stones captured and only single point eyes on the board ...
+double score_owners(Position *pos, Bitboard *own, Bitboard *opp)
+// compute score for to-play player and the points own and opp of each player;
+// this assumes a final position with all dead stones captured and only single
+// point eyes on the board ...
 {
     double s=pos->komi;
-    int    n=-1;
-    if (pos->n%2==0) {
-        s = -s;           // komi counts negatively for BLACK
-        n = 1;
+    if (pos->n%2==0) s = -s;           // komi counts negatively for BLACK
+
+    // the points of each player are his stones and the eyeish empty points
+    *own = eyeish_points(pos, &pos->bb_X); *opp = eyeish_points(pos, &pos->bb_x);
+    for (int k=0 ; k<BB_WORDS ; k++) {
+        own->w[k] |= pos->bb_X.w[k];
+        opp->w[k] |= pos->bb_x.w[k];
     }
+    return s + bb_count(own) - bb_count(opp);
+}
 
-    FORALL_POINTS(pos,pt) {
-        char c = pos->color[pt];
-        if (c=='.') c = is_eyeish(pos,pt);
-        if (c=='X') {
-            s += 1.0;
-            owner_map[pt] += n;
-        }
-        else if (c=='x') {
-            s -= 1.0;
-            owner_map[pt] -= n;
-        }
+double score(Position *pos, int owner_map[])
+// compute score for to-play player and add the owners of the points (+1 for
+// BLACK, -1 for WHITE) to owner_map
+{
+    Bitboard own, opp;
+    double   s = score_owners(pos, &own, &opp);
+    int      n = (pos->n%2==0) ? 1 : -1;
+    for (int k=0 ; k<BB_WORDS ; k++) {
+        for (unsigned long long b=own.w[k] ; b!=0 ; b&=b-1)
+            owner_map[64*k+__builtin_ctzll(b)] += n;
+        for (unsigned long long b=opp.w[k] ; b!=0 ; b&=b-1)
+            owner_map[64*k+__builtin_ctzll(b)] -= n;
     }
     return s;
 }
@@ -519,32 +963,40 @@ double score(Position *pos, int owner_map[])
 // complicated part of the whole program (sadly).
 // Feel free to just TREAT IT AS A BLACK-BOX, it's not really that interesting!
 
-Point read_ladder_attack(Position *pos, Point pt, Slist libs)
+// fix_atari() and read_ladder_attack() call each other. Their work arrays are
+// in a stack of frames allocated once per thread (one frame per call of
+// fix_atari() in progress) and the results of fix_atari() are memoized for the
+// position and the block (the position is identified by its Zobrist key).
+// (see ladder_frames and atari_memo)
+Point read_ladder_attack(Position *pos, Point pt, Slist libs, LadderFrame *f)
 // Check if a capturable ladder is being pulled out at pt and return a move
 // that continues it in that case. Expects its two liberties in libs.
 // Actually, this is a general 2-lib capture exhaustive solver.
+// f is the frame of the calling fix_atari()
 {
-    Point moves[5], sizes[5];   // 4 points should be enough ...
     Point move=0;
+    STATS_START_SAMPLED(ST_LADDER);
     FORALL_IN_SLIST(libs, l) {
-        Position pos_l = *pos;
-        char *ret = play_move(&pos_l, l);
+        char *ret = play_move_undoable(pos, l);
         if (ret[0]!=0) continue; // move not legal
         // fix_atari() will recursively call read_ladder_attack() back
         // however, ignore 2lib groups as we don't have time to chase them
-        slist_clear(moves); slist_clear(sizes);
-        int is_atari = fix_atari(&pos_l, pt, SINGLEPT_NOK, TWOLIBS_TEST_NO
-                                                           , 0, moves, sizes);
+        slist_clear(f->moves); slist_clear(f->sizes);
+        int is_atari = fix_atari(pos, pt, SINGLEPT_NOK, TWOLIBS_TEST_NO
+                                                     , 0, f->moves, f->sizes);
+        undo_move(pos);
         // if block is in atari and cannot escape, it is caugth in a ladder
-        if (is_atari && slist_size(moves) == 0)
+        if (is_atari && slist_size(f->moves) == 0)
             move = l;
     }
+    STATS_STOP_SAMPLED(ST_LADDER);
     return move;   // ladder attack not successful
 }
 
 int line_height(Point pt);
-int fix_atari(Position *pos, Point pt, int singlept_ok
-        , int twolib_test, int twolib_edgeonly, Slist moves, Slist sizes)
+__INLINE__ int fix_atari_block(Position *pos, Point pt, int twolib_test,
+                      int twolib_edgeonly, Slist moves, Slist sizes,
+                      LadderFrame *f)
 // An atari/capture analysis routine that checks the group at Point pt,
 // determining whether (i) it is in atari (ii) if it can escape it,
 // either by playing on its liberty or counter-capturing another group.
@@ -552,14 +1004,13 @@ int fix_atari(Position *pos, Point pt, int singlept_ok
 // Return 1 (true) if the group is in atari, 0 otherwise
 //        moves : a list of moves that capture or save blocks
 //        sizes : list of same lenght as moves (size of corresponding blocks)
-// singlept_ok!=0 means that we will not try to save one-point groups
+// f is the frame of the call (work arrays)
 {
     int in_atari=1, maxlibs=3;
-    Point stones[BOARDSIZE], l, libs[5], blocks[256], blibs[256];
+    Point l, libs[5];
+    Slist stones = f->stones;
 
-    slist_clear(moves); slist_clear(sizes);
     compute_block(pos, pt, stones, libs, maxlibs);
-    if (singlept_ok && slist_size(stones) == 1) return 0;
     if (slist_size(libs) >= 2) {
         if (twolib_test && slist_size(libs) == 2 && slist_size(stones) > 1) {
             if (twolib_edgeonly
@@ -571,7 +1022,7 @@ int fix_atari(Position *pos, Point pt, int singlept_ok
                 // check that the block cannot be caught in a working ladder
                 // If it can, that's as good as in atari, a capture threat.
                 // (Almost - N/A for countercaptures.)
-                Point ladder_attack = read_ladder_attack(pos, pt, libs);
+                Point ladder_attack = read_ladder_attack(pos, pt, libs, f);
                 if (ladder_attack) {
                     if(slist_insert(moves, ladder_attack))
                         slist_push(sizes, slist_size(stones));
@@ -590,29 +1041,68 @@ int fix_atari(Position *pos, Point pt, int singlept_ok
 
     // This is our group and it is in atari
     // Before thinking about defense, what about counter-capturing a neighbor ?
-    make_list_neighbor_blocks_in_atari(pos, stones, blocks, blibs);
-    FORALL_IN_SLIST(blibs, l)
+    make_list_neighbor_blocks_in_atari(pos, stones, f->blocks, f->blibs);
+    FORALL_IN_SLIST(f->blibs, l)
         if (slist_insert(moves, l))
             slist_push(sizes, slist_size(stones));
 
     l = libs[1];
     // We are escaping.
     // Will playing our last liberty gain/ at least two liberties?
-    Position escpos = *pos;
-    char *ret = play_move(&escpos, l);
+    char *ret = play_move_undoable(pos, l);
     if (ret[0]!=0)
         return 1;     // oops, suicidal move
-    compute_block(&escpos, l, stones, libs, maxlibs);
+    compute_block(pos, l, stones, libs, maxlibs);
     if (slist_size(libs) >= 2) {
         // Good, there is still some liberty remaining - but if it's just the
         // two, check that we are not caught in a ladder... (Except that we
         // don't care if we already have some alternative escape routes!)
         if (slist_size(moves)>1
-        || (slist_size(libs)==2 && read_ladder_attack(&escpos,l,libs) == 0)
+        || (slist_size(libs)==2 && read_ladder_attack(pos,l,libs,f) == 0)
         || (slist_size(libs)>=3))
             if (slist_insert(moves, l))
                 slist_push(sizes, slist_size(stones));
     }
+    undo_move(pos);
+    return in_atari;
+}
+
+int fix_atari(Position *pos, Point pt, int singlept_ok
+        , int twolib_test, int twolib_edgeonly, Slist moves, Slist sizes)
+// fix_atari_block() with its statistics, its memo and its frame
+// singlept_ok!=0 means that we will not try to save one-point groups
+{
+    int in_atari = 0;
+    STATS_START_SAMPLED(ST_FIX_ATARI);
+    slist_clear(moves); slist_clear(sizes);
+    if ((singlept_ok && pos->next[pt] == pt)
+            || (!twolib_test && !block_in_atari(pos, pos->block[pt])))
+        goto done;
+    ZobristHash key = position_key(pos) + 0x9E3779B97F4A7C15ULL
+              * (4*pos->block[pt] + 2*(twolib_test != 0)
+                                  + (twolib_edgeonly != 0) + 1);
+    AtariMemo *m = &atari_memo[key >> (64 - ATARI_MEMO_BITS)];
+    if (m->key == key) {
+        for (int k=0 ; k<m->nmoves ; k++) {
+            slist_push(moves, m->moves[k]); slist_push(sizes, m->sizes[k]);
+        }
+        in_atari = m->in_atari;
+        STATS_INC(atari_memo_hits, 1);
+        goto done;
+    }
+    if (ladder_depth == MAX_LADDER_DEPTH) goto done;   // cannot happen
+    LadderFrame *f = &ladder_frames[ladder_depth++];
+    in_atari = fix_atari_block(pos, pt, twolib_test, twolib_edgeonly, moves,
+                                                                   sizes, f);
+    ladder_depth--;
+    if (slist_size(moves) <= ATARI_MEMO_MOVES) {
+        m->key = key; m->in_atari = in_atari; m->nmoves = slist_size(moves);
+        for (int k=0 ; k<m->nmoves ; k++) {
+            m->moves[k] = moves[k+1]; m->sizes[k] = sizes[k+1];
+        }
+    }
+done:
+    STATS_STOP_SAMPLED(ST_FIX_ATARI);
     return in_atari;
 }
 
@@ -622,15 +1112,19 @@ void compute_cfg_distances(Position *pos, Point pt, char cfg_map[BOARDSIZE])
 // single points.
 {
     int   head=1, k, tail=0;
-    Point fringe[30*BOARDSIZE], n;
+    Point fringe[BOARDSIZE], n;
+    char  in_fringe[BOARDSIZE];
 
     memset(cfg_map, -1, BOARDSIZE);
+    memset(in_fringe, 0, BOARDSIZE);
     cfg_map[pt] = 0;
 
-    // flood-fill like mechanics
-    fringe[0]=pt;
-    while(head > tail) {
-        pt = fringe[tail++];
+    // flood-fill like mechanics. A point is in the fringe at most once at a
+    // time, so that the fringe is a circular buffer of BOARDSIZE points
+    fringe[0]=pt; in_fringe[pt] = 1;
+    while(head != tail) {
+        pt = fringe[tail]; tail = (tail+1) % BOARDSIZE;
+        in_fringe[pt] = 0;
         FORALL_NEIGHBORS(pos, pt, k, n) {
             char c = pos->color[n];
             if (c==' ') continue;
@@ -640,9 +1134,9 @@ void compute_cfg_distances(Position *pos, Point pt, char cfg_map[BOARDSIZE])
                 cfg_map[n] = cfg_map[pt];
             else
                 cfg_map[n] = cfg_map[pt]+1;
-            if (cfg_before < 0 || cfg_before > cfg_map[n]) {
-                fringe[head++] = n;
-                assert(head < 30*BOARDSIZE);
+            if ((cfg_before < 0 || cfg_before > cfg_map[n]) && !in_fringe[n]) {
+                fringe[head] = n; head = (head+1) % BOARDSIZE;
+                in_fringe[n] = 1;
             }
         }
     }
@@ -659,6 +1153,31 @@ int line_height(Point pt)
     else           return col-1;
 }
 
+void compute_stone_distances(Position *pos, int dist, char dist_map[BOARDSIZE])
+// Return a board map with the distance of each empty point to the nearest stone
+// (along paths of empty points), dist+1 if it is larger than dist.
+// empty_area(pos, pt, dist) is equivalent to dist_map[pt] > dist.
+{
+    int   head=0, tail=0, k;
+    Point fringe[BOARDSIZE], n;
+
+    memset(dist_map, dist+1, BOARDSIZE);
+    FORALL_POINTS(pos, pt)
+        if (pos->color[pt]=='x' || pos->color[pt]=='X') {
+            dist_map[pt] = 0;
+            fringe[head++] = pt;
+        }
+    while (head > tail) {
+        Point pt = fringe[tail++];
+        if (dist_map[pt] >= dist) continue;
+        FORALL_NEIGHBORS(pos, pt, k, n)
+            if (pos->color[n]=='.' && dist_map[n] > dist_map[pt]+1) {
+                dist_map[n] = dist_map[pt]+1;
+                fringe[head++] = n;
+            }
+    }
+}
+
 int empty_area(Position *pos, Point pt, int dist)
 // Check whether there are any stones in Manhattan distance up to dist
 {
@@ -709,7 +1228,7 @@ int gen_playout_moves_pat3(Position *pos, Slist heuristic_set, float prob,
     mark_init(already_suggested);
     if (random_int(1000) <= prob*1000.0)
         FORALL_IN_SLIST(heuristic_set, pt)
-            if (pos->color[pt] == '.' && pat3_match(pos, pt))
+            if (bb_is_set(&pos->bb_pat3, pt))   // empty and pat3_match()
                slist_push(moves, pt);
     mark_release(already_suggested);
     return slist_size(moves);
@@ -720,60 +1239,126 @@ int gen_playout_moves_random(Position *pos, Point moves[BOARDSIZE], Point i0)
 // does not include true-eye-filling moves), starting from a given board index
 // (that can be used for randomization)
 {
+    Bitboard eyes=true_eyes(pos);      // ignore true eyes for player
     slist_clear(moves);
-    for(Point i=i0 ; i<BOARD_IMAX ; i++) {
-        if (pos->color[i] != '.') continue;    // ignore NOT EMPTY Points
-        if (is_eye(pos,i) == 'X') continue;    // ignore true eyes for player
-        slist_push(moves, i);
-    }
-    for(Point i=BOARD_IMIN-1 ; i<i0 ; i++) {
-        if (pos->color[i] != '.') continue;    // ignore NOT EMPTY Points
-        if (is_eye(pos,i) == 'X') continue;    // ignore true eyes for player
-        slist_push(moves, i);
-    }
+    for (int pass=0 ; pass<2 ; pass++)  // first the points >= i0, then < i0
+        for (int k=0 ; k<BB_WORDS ; k++) {
+            unsigned long long b = pos->bb_empty.w[k] & ~eyes.w[k], lo;
+            if (64*k >= i0)                 lo = 0;
+            else if (64*(k+1) <= i0)        lo = ~0ULL;
+            else                            lo = (1ULL << (i0-64*k)) - 1;
+            b &= (pass == 0 ? ~lo : lo);
+            for ( ; b!=0 ; b&=b-1)
+                slist_push(moves, 64*k+__builtin_ctzll(b));
+        }
     return slist_size(moves);
 }
 
+__INLINE__ int surely_not_rejected(Position *pos, Point pt)
+// Return 1 if the self-atari test of the move at pt (fix_atari() of its block
+// with SINGLEPT_OK) would surely find no move, without playing it: the block
+// will be a single stone (no neighbor of the player) or it will have at least
+// 3 liberties (3 empty neighbors). The colors of the neighbors are in env4.
+{
+    int hi = pos->env4[pt] >> 4, lo = pos->env4[pt] & 15;
+    int own = ~hi & (pos->n%2 == 0 ? lo : ~lo) & 15;   // BLACK=01 WHITE=00
+    return own == 0 || __builtin_popcount(hi & ~lo) >= 3;   // EMPTY=10
+}
+
 Point choose_from(Position *pos, Slist moves, char *kind, int disp)
 {
     char   *ret;
     Info   sizes[20];
     Point  move = PASS_MOVE, ds[20];
-    Position saved_pos = *pos;
+    int    is_random = (strcmp(kind, "random") == 0);
+    double prob_reject = (is_random ? PROB_RSAREJECT : PROB_SSAREJECT);
 
     FORALL_IN_SLIST(moves, pt) {
-        if (disp && strcmp(kind, "random")!=0)
+        if (disp && !is_random)
             fprintf(stderr,"move suggestion (%s) %s\n", kind,str_coord(pt,buf));
-        ret = play_move(pos, pt);
-        if (ret[0] == 0) {    // move OK
+        // decide first if the move will be checked for self-atari (only
+        // these moves need to be undoable). The test is skipped if its
+        // result is known.
+        int r = random_int(10000);
+        if (r > 10000.0*prob_reject || surely_not_rejected(pos, pt)) {
+            ret = play_move(pos, pt);
+            if (ret[0] != 0) continue;
             move = pt;
-            // check if the suggested move did not turn out to be a self-atari
-            int r = random_int(10000), tstrej;
-            if (strcmp(kind,"random") == 0) tstrej = r<=10000.0*PROB_RSAREJECT;
-            else                            tstrej = r<= 10000.0*PROB_SSAREJECT;
-            if (tstrej) {
-                slist_clear(ds); slist_clear(sizes);
-                fix_atari(pos, pt, SINGLEPT_OK, TWOLIBS_TEST, 1, ds, sizes);
-                if (slist_size(ds) > 0) {
-                    if(disp) fprintf(stderr, "rejecting self-atari move %s\n",
-                                                           str_coord(pt, buf));
-                    *pos = saved_pos; // undo move;
-                    move = PASS_MOVE;
-                    continue;
-                }
-            }
             break;
         }
+        ret = play_move_undoable(pos, pt);
+        if (ret[0] != 0) continue;    // move not legal
+        // check if the suggested move did not turn out to be a self-atari
+        slist_clear(ds); slist_clear(sizes);
+        fix_atari(pos, pt, SINGLEPT_OK, TWOLIBS_TEST, 1, ds, sizes);
+        if (slist_size(ds) > 0) {
+            if(disp) fprintf(stderr, "rejecting self-atari move %s\n",
+                                                       str_coord(pt, buf));
+            STATS_INC(rejected, 1);
+            undo_move(pos);
+            continue;
+        }
+        keep_move(pos);
+        move = pt;
+        break;
     }
     return move;
 }
 
-double mcplayout(Position *pos, int amaf_map[], int owner_map[], int disp)
-// Start a Monte Carlo playout from a given position, return score for to-play
-// player at the starting position; amaf_map is board-sized scratchpad recording// who played at a given position first
+void swap_empty(Position *pos, int i, int j)
+// Exchange the points of index i and j in the empty set
+{
+    Point pi=pos->empty[i], pj=pos->empty[j];
+    pos->empty[i] = pj; pos->empty_idx[pj] = i;
+    pos->empty[j] = pi; pos->empty_idx[pi] = j;
+}
+
+Point choose_random_move(Position *pos, int disp)
+// Play a random move among the empty points that are not true eyes for the
+// player (and return it) or return PASS_MOVE if there is no such move.
+// The candidates are pos->empty[0..m-1]: each tried point is swapped at the
+// end of this range which is then shrunk (partial Fisher-Yates shuffle), so
+// that the expected cost is O(1) when most of the empty points are legal
+{
+    Info     sizes[20];
+    Point    ds[20];
+
+    for (int m=pos->nempty ; m>0 ; m--) {
+        int   k = random_int(m);
+        Point pt = pos->empty[k];
+        swap_empty(pos, k, m-1);
+        if (is_eye(pos, pt) == 'X') continue;  // ignore true eyes for player
+        // decide first if the move will be checked for self-atari (as in
+        // choose_from())
+        if (random_int(10000) > 10000.0*PROB_RSAREJECT
+                                     || surely_not_rejected(pos, pt)) {
+            if (play_move(pos, pt)[0] != 0) continue;
+            return pt;
+        }
+        char *ret = play_move_undoable(pos, pt);
+        if (ret[0] != 0) continue;
+        // check if the move did not turn out to be a self-atari
+        slist_clear(ds); slist_clear(sizes);
+        fix_atari(pos, pt, SINGLEPT_OK, TWOLIBS_TEST, 1, ds, sizes);
+        if (slist_size(ds) > 0) {
+            if(disp) fprintf(stderr, "rejecting self-atari move %s\n",
+                                                       str_coord(pt, buf));
+            STATS_INC(rejected, 1);
+            undo_move(pos);     // the order of the empty set is restored too
+            continue;
+        }
+        keep_move(pos);
+        return pt;
+    }
+    return PASS_MOVE;
+}
+
+void mcplayout_moves(Position *pos, int amaf_map[], int disp)
+// Play the moves of a Monte Carlo playout from a given position until the end
+// of the game; amaf_map is board-sized scratchpad recording who played at a
+// given position first
 {
-    double s=0.0;
-    int    passes=0, start_n=pos->n;
+    int    passes=0;
     Info   sizes[BOARDSIZE];
     Point  last_moves_neighbors[20], moves[BOARDSIZE], move;
     if(disp) fprintf(stderr, "** SIMULATION **\n");
@@ -798,8 +1383,7 @@ double mcplayout(Position *pos, int amaf_map[], int owner_map[], int disp)
             if((move=choose_from(pos, moves, "pat3", disp)) != PASS_MOVE)
                 goto found;
 
-        gen_playout_moves_random(pos, moves, BOARD_IMIN-1+random_int(N*W));
-        move=choose_from(pos, moves, "random", disp);
+        move = choose_random_move(pos, disp);
 found:
         if (move == PASS_MOVE) {      // No valid move : pass
             pass_move(pos);
@@ -812,52 +1396,277 @@ found:
             passes=0;
         }
     }
-    s = score(pos, owner_map);
+}
+
+double mcplayout(Position *pos, int amaf_map[], int owner_map[], int disp)
+// Start a Monte Carlo playout from a given position, return score for to-play
+// player at the starting position (see mcplayout_moves())
+{
+    int    start_n=pos->n;
+    mcplayout_moves(pos, amaf_map, disp);
+    double s = score(pos, owner_map);
     if (start_n%2 != pos->n%2) s = -s;
     return s;
 }
 //========================== Montecarlo tree search ===========================
-TreeNode* new_tree_node(Position *pos)
+// Transposition table: the nodes of the tree are indexed by the Zobrist key
+// of their position, so that a position reached by another move order gets
+// the statistics of the moves already searched there (see expand()).
+// The table has a fixed size (option -m) and is shared by the threads
+// without locks: an entry is written in two words and checked when read (see
+// TTEntry). A new entry overwrites the old one.
+TTEntry      *tt;                       // the table (NULL if disabled)
+ZobristHash  tt_mask;                   // number of entries - 1
+ZobristHash  tt_salt;                   // changed to invalidate all entries
+int          tt_mb = TT_MB;             // size of the table (MB)
+
+void tt_init(int mb)
+// Allocate a table of at most mb MB (the number of entries is a power of 2)
+{
+    free(tt); tt = NULL;
+    if (mb <= 0) return;
+    ZobristHash n = 1;
+    while (2*n*sizeof(TTEntry) <= (ZobristHash) mb<<20) n *= 2;
+    tt = calloc(n, sizeof(TTEntry));
+    tt_mask = n - 1;
+    log_fmt_i('I', "transposition table: %d MB", (int) (n*sizeof(TTEntry)>>20));
+}
+
+void tt_clear(void)
+// Invalidate all the entries (the nodes they point to are released)
+{
+    tt_salt += 0x9E3779B97F4A7C15ULL;
+}
+
+ZobristHash tt_key(Position *pos)
+{
+    return position_key(pos) ^ tt_salt;
+}
+
+TreeNode* tt_lookup(ZobristHash key)
+// Return the node stored for key or NULL
+{
+    TTEntry *e = &tt[key & tt_mask];
+    ZobristHash check = __atomic_load_n(&e->check, __ATOMIC_RELAXED);
+    ZobristHash data  = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+    if ((check ^ data) != key) return NULL;
+    return (TreeNode *) data;
+}
+
+void tt_store(ZobristHash key, TreeNode *node)
+{
+    TTEntry *e = &tt[key & tt_mask];
+    ZobristHash data = (ZobristHash) node;
+    __atomic_store_n(&e->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->check, key ^ data, __ATOMIC_RELAXED);
+}
+
+// The tree is kept from one move to the next : the subtree corresponding to
+// the move played is copied into the other arena and the old tree released
+Arena arenas[2] = {{NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER},
+                   {NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER}};
+Arena *tree_arena = &arenas[0];         // arena of the current tree
+Position root_pos;                      // position at the root of the tree
+
+void* arena_alloc(Arena *arena, size_t size, int n)
+// Allocate size bytes for n tree nodes (thread safe)
+{
+    char     *mem;
+    assert(size <= ARENA_CHUNK);
+
+    pthread_mutex_lock(&arena->mutex);
+    Chunk *c = arena->current;
+    if (c == NULL || c->used + size > ARENA_CHUNK) {
+        // Go to the next chunk (reused from a previous tree if possible)
+        c = (c == NULL ? arena->first : c->next);
+        if (c == NULL) {
+            c = malloc(sizeof(Chunk));
+            c->next = NULL;
+            if (arena->current == NULL) arena->first = c;
+            else                        arena->current->next = c;
+        }
+        c->used = 0;
+        arena->current = c;
+    }
+    mem = c->mem + c->used;
+    c->used += size;
+    arena->used += size;
+    arena->nnodes += n;
+    pthread_mutex_unlock(&arena->mutex);
+    return mem;
+}
+
+TreeNode* arena_alloc_nodes(Arena *arena, int n)
+// Allocate an array of n tree nodes (thread safe)
+{
+    return arena_alloc(arena, n*sizeof(TreeNode), n);
+}
+
+TreeNode* arena_alloc_children(Arena *arena, int n)
+// Allocate an array of n children, preceded by the set of their moves (see
+// CHILD_MOVES())
+{
+    char *mem = arena_alloc(arena, sizeof(Bitboard) + n*sizeof(TreeNode), n);
+    return (TreeNode *) (mem + sizeof(Bitboard));
+}
+
+void arena_reset(Arena *arena)
+// Release all the nodes at once
+{
+    arena->current = NULL;
+    arena->used = arena->nnodes = 0;
+    tt_clear();
+}
+
+void arena_free(Arena *arena)
+// Give back the memory of the arena to the system
 {
-    TreeNode *node = calloc(1,sizeof(TreeNode));
-    node->pos = *pos;
+    for (Chunk *c=arena->first, *next ; c!=NULL ; c=next) {
+        next = c->next;
+        free(c);
+    }
+    arena->first = NULL;
+    arena_reset(arena);
+}
+
+void init_tree_node(TreeNode *node, Point move)
+{
+    node->v = node->w = node->av = node->aw = 0;
     node->pv = PRIOR_EVEN; node->pw = PRIOR_EVEN/2;
+    node->nchildren = 0;
+    node->move = move;
+    node->rank = 0;
+    node->children = NULL;
+}
+
+TreeNode* new_tree(Position *pos)
+// Release the current tree and return a new root node for position pos
+{
+    arena_reset(tree_arena);
+    TreeNode *node = arena_alloc_nodes(tree_arena, 1);
+    init_tree_node(node, pos->last);
+    root_pos = *pos;
     return node;
 }
 
-void expand(TreeNode *tree)
-// add and initialize children to a leaf node
+int same_position(Position *pos1, Position *pos2)
+{
+    return pos1->n == pos2->n && pos1->ko == pos2->ko
+        && memcmp(pos1->color, pos2->color, BOARDSIZE) == 0;
+}
+
+void copy_subtree(Arena *arena, TreeNode *dest, TreeNode *src)
+// Copy node src and all its descendants in dest (allocated in arena)
+{
+    *dest = *src;
+    if (src->children == NULL) return;
+    dest->children = arena_alloc_children(arena, src->nchildren);
+    *CHILD_MOVES(dest->children) = *CHILD_MOVES(src->children);
+    for (int k=0 ; k<src->nchildren ; k++)
+        copy_subtree(arena, &dest->children[k], &src->children[k]);
+}
+
+TreeNode* advance_tree(TreeNode *tree, Point move, Position *pos)
+// Return the tree for position pos reached by playing move from the root of
+// tree. The statistics of the subtree of this move are kept if it exists.
+{
+    Position pos2 = root_pos;
+    TreeNode *child=NULL;
+    Arena    *other = (tree_arena == &arenas[0] ? &arenas[1] : &arenas[0]);
+
+    if (tree->children != NULL)
+        for (int k=0 ; k<tree->nchildren ; k++)
+            if (tree->children[k].move == move)
+                child = &tree->children[k];
+    if (child != NULL) {
+        if (move == PASS_MOVE) pass_move(&pos2);
+        else                   play_move(&pos2, move);
+    }
+    if (child == NULL || !same_position(&pos2, pos))
+        return new_tree(pos);
+
+    arena_reset(other);
+    TreeNode *root = arena_alloc_nodes(other, 1);
+    copy_subtree(other, root, child);
+    arena_reset(tree_arena);
+    tree_arena = other;
+    root_pos = *pos;
+    log_fmt_i('I', "tree reused (%d visits)", root->v);
+    return root;
+}
+
+int cmp_key(const void *a, const void *b)
+{
+    unsigned long long k1 = *(unsigned long long *) a;
+    unsigned long long k2 = *(unsigned long long *) b;
+    return (k1 > k2) - (k1 < k2);
+}
+
+void rank_children(TreeNode *children, int nchildren)
+// Set the rank of the children by decreasing prior value (see most_urgent()).
+// The key of a child is its index below the bits of 2 - pw/pv (a positive
+// float, so that the keys are sorted as integers).
+{
+    unsigned long long key[BOARDSIZE];
+    for (int k=0 ; k<nchildren ; k++) {
+        float    x = 2.0f - (float) children[k].pw / children[k].pv;
+        unsigned int bits;
+        memcpy(&bits, &x, sizeof(bits));
+        key[k] = ((unsigned long long) bits << 32) | k;
+    }
+    qsort(key, nchildren, sizeof(key[0]), cmp_key);
+    for (int k=0 ; k<nchildren ; k++) children[key[k] & 0xFFFF].rank = k;
+}
+
+void expand(TreeNode *tree, Position *pos)
+// add and initialize children to a leaf node (pos is the position of the node)
+// The children are made visible to the other threads only when they are
+// completely initialized
+// The priors are computed in batch: the legal moves are found once (childset),
+// the heuristics that suggest moves reuse them and the board maps (cfg, stone
+// distances) are computed once for all the children.
 {
-    char     cfg_map[BOARDSIZE];
+    char     cfg_map[BOARDSIZE], dist_map[BOARDSIZE];
     int      nchildren = 0;
-    Info     sizes[BOARDSIZE];
-    Point    moves[BOARDSIZE];
-    Position pos2;
-    TreeNode *childset[BOARDSIZE], *node;
-    if (tree->pos.last!=PASS_MOVE)
-        compute_cfg_distances(&tree->pos, tree->pos.last, cfg_map);
+    Info     sizes[BOARDSIZE], sizes2[BOARDSIZE];
+    Point    moves[BOARDSIZE], moves2[BOARDSIZE];
+    TreeNode *children, *childset[BOARDSIZE], *node;
+    STATS_START(ST_EXPAND);
+    if (pos->last!=PASS_MOVE)
+        compute_cfg_distances(pos, pos->last, cfg_map);
+    compute_stone_distances(pos, 3, dist_map);
+    memset(childset, 0, sizeof(childset));
 
     // Use light random playout generator to get all the empty points (not eye)
-    gen_playout_moves_random(&tree->pos, moves, BOARD_IMIN-1);
+    gen_playout_moves_random(pos, moves, BOARD_IMIN-1);
 
-    tree->children = calloc(slist_size(moves)+2, sizeof(TreeNode*));
+    // Room for all the points (the illegal ones are rare) or a pass move
+    children = arena_alloc_children(tree_arena, slist_size(moves)+1);
     FORALL_IN_SLIST(moves, pt) {
-        pos2 = tree->pos;
-        assert(tree->pos.color[pt] == '.');
-        char* ret = play_move(&pos2, pt);
+        assert(pos->color[pt] == '.');
+        char* ret = play_move_undoable(pos, pt);
         if (ret[0] != 0) continue;
         // pt is a legal move : we build a new node for it
-        childset[pt]= tree->children[nchildren++] = new_tree_node(&pos2);
+        childset[pt] = node = &children[nchildren++];
+        init_tree_node(node, pt);
+
+        // Negative prior for self-atari (the position of the child is only
+        // available here)
+        fix_atari(pos, pt, SINGLEPT_OK, TWOLIBS_TEST, !TWOLIBS_EDGE_ONLY,
+                                                               moves2, sizes2);
+        if (slist_size(moves2) > 0) {
+            node->pv += PRIOR_SELFATARI;
+            node->pw += 0;  // negative prior
+        }
+        undo_move(pos);
     }
-    tree->nchildren = nchildren;
 
     // Update the prior for the 'capture' and 3x3 patterns suggestions
-    gen_playout_moves_capture(&tree->pos, allpoints, 1, 1, moves, sizes);
+    // (a suggested move is legal iff it has a child)
+    gen_playout_moves_capture(pos, allpoints, 1, 1, moves, sizes);
     int k=1;
     FORALL_IN_SLIST(moves, pt) {
-        pos2 = tree->pos;
-        char* ret = play_move(&pos2, pt);
-        if (ret[0] != 0) continue;
+        if (childset[pt] == NULL) continue;
         node = childset[pt];
         if (sizes[k] == 1) {
             node->pv += PRIOR_CAPTURE_ONE;
@@ -869,29 +1678,29 @@ void expand(TreeNode *tree)
         }
         k++;
     }
-    gen_playout_moves_pat3(&tree->pos, allpoints, 1, moves);
-    FORALL_IN_SLIST(moves, pt) {
-        pos2 = tree->pos;
-        char* ret = play_move(&pos2, pt);
-        if (ret[0] != 0) continue;
-        node = childset[pt];
-        node->pv += PRIOR_PAT3;
-        node->pw += PRIOR_PAT3;
-    }
+    // (the points that match a 3x3 pattern are read in bulk in bb_pat3)
+    for (int k=0 ; k<BB_WORDS ; k++)
+        for (unsigned long long b=pos->bb_pat3.w[k] ; b!=0 ; b&=b-1) {
+            node = childset[64*k+__builtin_ctzll(b)];
+            if (node == NULL) continue;
+            node->pv += PRIOR_PAT3;
+            node->pw += PRIOR_PAT3;
+        }
 
     // Second pass setting priors, considering each move just once now
-    copy_to_large_board(&tree->pos);    // For large patterns
-    for (int k=0 ; k<tree->nchildren ; k++) {
-        node = tree->children[k];
-        Point pt = node->pos.last;
+    copy_to_large_board(pos);    // For large patterns
+    for (int k=0 ; k<nchildren ; k++) {
+        node = &children[k];
+        Point pt = node->move;
 
-        if (tree->pos.last != PASS_MOVE && cfg_map[pt]-1 < LEN_PRIOR_CFG) {
+        if (pos->last != PASS_MOVE && cfg_map[pt]-1 < LEN_PRIOR_CFG) {
             node->pv += PRIOR_CFG[cfg_map[pt]-1];
             node->pw += PRIOR_CFG[cfg_map[pt]-1];
         }
 
         int height = line_height(pt);  // 0-indexed
-        if (height <= 2 && empty_area(&tree->pos, pt, 3)) {
+        assert((dist_map[pt] > 3) == empty_area(pos, pt, 3));
+        if (height <= 2 && dist_map[pt] > 3) {     // empty_area(pos, pt, 3)
             // No stones around; negative prior for 1st + 2nd line, positive
             // for 3rd line; sanitizes opening and invasions
             if (height <= 1) {
@@ -904,13 +1713,6 @@ void expand(TreeNode *tree)
             }
         }
 
-        fix_atari(&node->pos, pt, SINGLEPT_OK, TWOLIBS_TEST, !TWOLIBS_EDGE_ONLY,
-                                                                 moves, sizes);
-        if (slist_size(moves) > 0) {
-            node->pv += PRIOR_SELFATARI;
-            node->pw += 0;  // negative prior
-        }
-
         double patternprob = large_pattern_probability(pt);
         if (patternprob > 0.0) {
             double pattern_prior = sqrt(patternprob);       // tone up
@@ -919,24 +1721,40 @@ void expand(TreeNode *tree)
         }
     }
 
-    if (tree->nchildren == 0) {
-        // No possible move, add a pass move
-        pos2 = tree->pos;
-        pass_move(&pos2);
-        tree->children[0] = new_tree_node(&pos2);
-        tree->nchildren = 1;
+    // A transposition of the position is already in the tree: its children
+    // statistics are added to the priors of the same moves
+    if (tt != NULL) {
+        ZobristHash key = tt_key(pos);
+        TreeNode *other = tt_lookup(key), *ochildren;
+        if (other == NULL)
+            tt_store(key, tree);
+        else if (other != tree && (ochildren = __atomic_load_n(
+                                   &other->children, __ATOMIC_ACQUIRE))) {
+            for (int k=0 ; k<other->nchildren ; k++) {
+                Point pt = ochildren[k].move;
+                if ((node = childset[pt]) == NULL) continue;
+                node->pv += ochildren[k].v;
+                node->pw += ochildren[k].w;
+            }
+            STATS_INC(transpositions, 1);
+        }
     }
-}
 
-void free_tree(TreeNode *tree)
-// Free memory allocated for the tree
-{
-    if (tree->children != NULL) {
-        for (TreeNode **child = tree->children ; *child != NULL ; child++)
-                free_tree(*child);
-        free(tree->children);
+    rank_children(children, nchildren);
+    Bitboard *child_moves = CHILD_MOVES(children);
+    memset(child_moves, 0, sizeof(Bitboard));
+    for (int k=0 ; k<nchildren ; k++) {
+        assert(k == 0 || children[k].move > children[k-1].move);
+        bb_set(child_moves, children[k].move);
+    }
+    if (nchildren == 0) {
+        // No possible move, add a pass move (not in child_moves)
+        init_tree_node(&children[nchildren++], PASS_MOVE);
     }
-    free(tree);
+    tree->nchildren = nchildren;
+    __atomic_store_n(&tree->children, children, __ATOMIC_RELEASE);
+    STATS_INC(nodes, nchildren);
+    STATS_STOP(ST_EXPAND);
 }
 
 double rave_urgency(TreeNode *node)
@@ -966,140 +1784,687 @@ TreeNode* best_move(TreeNode *tree, TreeNode **except)
 
     if (tree->children == NULL) return NULL;
 
-    for (TreeNode **child = tree->children ; *child != NULL ; child++) {
-        if ((*child)->v > vmax) {
+    for (int k=0 ; k<tree->nchildren ; k++) {
+        TreeNode *child = &tree->children[k];
+        if (child->v > vmax) {
             int update = 1;
             if (except != NULL)
                 for (TreeNode **n=except ; *n!=NULL ; n++)
-                    if (*child == *n) update=0;
+                    if (child == *n) update=0;
             if (update) {
-                vmax = (*child)->v;
-                best = (*child);
+                vmax = child->v;
+                best = child;
             }
         }
     }
     return best;
 }
 
-TreeNode* most_urgent(TreeNode **children, int nchildren, int disp)
+int widening(int v)
+// Number of children searched at a node of v visits (progressive widening):
+// the PW_INIT best ones by prior value at first, one more each time the
+// visits are multiplied by PW_RATE after PW_VISITS. The other children get
+// their AMAF statistics meanwhile (see tree_update()).
 {
-    int    k=0;
-    double urgency, umax=0;
-    TreeNode *urgent = children[0];
-
-    // Randomize the order of the nodes
-    SHUFFLE(TreeNode *, children, nchildren);
+    if (v <= PW_VISITS) return PW_INIT;
+    return PW_INIT + 1 + (int) (log((double) v / PW_VISITS) / log(PW_RATE));
+}
 
-    for (TreeNode **child = children ; *child != NULL ; child++) {
+TreeNode* most_urgent(TreeNode *children, int nchildren, int width, int disp)
+// Most urgent child among the width best ones by prior value
+{
+    int n=0;
+    double urgency, umax=0;
+    TreeNode *shuffled[BOARDSIZE], *urgent;
+
+    // Randomize the order of the nodes (in a private array because the
+    // children are shared by the threads of the search)
+    for (int k=0 ; k<nchildren ; k++)
+        if (children[k].rank < width) shuffled[n++] = &children[k];
+    SHUFFLE(TreeNode *, shuffled, n);
+
+    // n > 0 since the child of rank 0 is always searched (the compiler does
+    // not know it)
+    urgent = (n > 0) ? shuffled[0] : &children[0];
+    for (int k=0 ; k<n ; k++) {
         if (disp)
-            dump_subtree(*child, N_SIMS/50, "", stderr, 0);
-        urgency = rave_urgency(*child);
+            dump_subtree(shuffled[k], N_SIMS/50, "", stderr, 0);
+        urgency = rave_urgency(shuffled[k]);
         if (urgency > umax) {
             umax = urgency;
-            urgent = *child;
+            urgent = shuffled[k];
         }
-        k++;
     }
     return urgent;
 }
 
-int tree_descend(TreeNode *tree, int amaf_map[], int disp, TreeNode **nodes)
-// Descend through the tree to a leaf
+int tree_descend(TreeNode *tree, Position *pos, int amaf_map[], int nvisits,
+                                                    int disp, TreeNode **nodes)
+// Descend through the tree to a leaf. pos is the position of the root on entry
+// and the position of the leaf on return (the moves are replayed)
+// The visit count of the traversed nodes is incremented at once by the number
+// of playouts that will be run from the leaf (virtual loss) so that the other
+// threads of the search are driven towards other nodes
 {
     int last=0, passes = 0;
     Point move;
-    //tree->v += 1;
+    TreeNode *children;
+    __sync_fetch_and_add(&tree->v, nvisits);
     nodes[last] = tree;
 
-    while (nodes[last]->children != NULL && passes <2) {
-        if (disp) print_pos(&nodes[last]->pos, stderr, NULL);
+    while ((children=__atomic_load_n(&nodes[last]->children, __ATOMIC_ACQUIRE))
+                                                   != NULL && passes <2) {
+        if (disp) print_pos(pos, stderr, NULL);
         // Pick the most urgent child
-        TreeNode *node = most_urgent(nodes[last]->children,
-                                            nodes[last]->nchildren, disp);
+        TreeNode *node = most_urgent(children, nodes[last]->nchildren,
+                                     widening(nodes[last]->v), disp);
         nodes[++last] = node;
-        move = node->pos.last;
+        move = node->move;
         if (disp) { fprintf(stderr, "chosen "); ppoint(move); }
 
-        if (move == PASS_MOVE) passes++;
+        if (move == PASS_MOVE) {
+            passes++;
+            pass_move(pos);
+        }
         else {
             passes = 0;
             if (amaf_map[move] == 0) //Mark the point with 1 for black
-                amaf_map[move] = (nodes[last-1]->pos.n%2==0 ? 1 : -1);
+                amaf_map[move] = (pos->n%2==0 ? 1 : -1);
+            play_move(pos, move);
         }
 
-        if (node->children == NULL && node->v >= EXPAND_VISITS)
-            expand(node);
+        // nchildren is set to -1 by the (only) thread that expands the node
+        if (node->children == NULL && node->v >= EXPAND_VISITS
+                 && __sync_bool_compare_and_swap(&node->nchildren, 0, -1))
+            expand(node, pos);
+        __sync_fetch_and_add(&node->v, nvisits);
     }
     return last;
 }
 
-void tree_update(TreeNode **nodes,int last,int amaf_map[],double score,int disp)
-// Store simulation result in the tree (nodes is the tree path)
+typedef struct { // ------------ Results of the playouts of a leaf ----------
+    int n;                    // number of playouts
+    int wins;                 // playouts won by the player to play at the leaf
+    int av[2][BOARDSIZE];     // playouts where the point was played first by
+    int aw[2][BOARDSIZE];     // BLACK (0) or WHITE (1), and those won (leaf)
+    Bitboard played[2];       // the points where av is not 0
+} LeafResults;
+
+void leaf_results_add(LeafResults *res, int amaf_map[], double score)
+// Add the result of one playout (score and amaf_map of mcplayout())
+{
+    int won = (score > 0.0);
+    res->n++;
+    res->wins += won;
+    FORALL_POINTS(pos, pt) {
+        if (amaf_map[pt] == 0) continue;
+        int c = (amaf_map[pt] == 1 ? 0 : 1);
+        res->av[c][pt]++;
+        res->aw[c][pt] += won;
+        bb_set(&res->played[c], pt);
+    }
+}
+
+void tree_update(TreeNode **nodes, int last, int n, LeafResults *res, int disp)
+// Store the results of the playouts of the leaf in the tree (nodes is the tree
+// path and n the move number at the root), with one pass over the path for
+// all of them. The visits have already been counted by tree_descend()
 {
+    int flip = 0;           // 1 if to-play at node k is not to-play at leaf
     for (int k=last ; k>=0 ; k--) {     // walk nodes from leaf to the root
-        TreeNode *n= nodes[k];
+        TreeNode *node = nodes[k], *children;
+        // wins are for to-play, node stats for just-played
+        int wins = (flip ? res->wins : res->n - res->wins);
         if(disp) {
-            char str[8]; str_coord(n->pos.last,str);
-            fprintf(stderr, "updating %s %d\n", str, score<0.0);
+            char str[8]; str_coord(node->move,str);
+            fprintf(stderr, "updating %s %d/%d\n", str, wins, res->n);
         }
-        n->v += 1;         // TODO put it in tree_descend when parallelize
-        n->w += score<0.0; // score is for to-play, node stats for just-played
+        if (wins > 0) __sync_fetch_and_add(&node->w, wins);
 
         // Update the node children AMAF stats with moves we made
-        // with their color
-        int amaf_map_value = (n->pos.n %2 == 0 ? 1 : -1);
-        if (n->children != NULL) {
-            for (TreeNode **child = n->children ; *child != NULL ; child++) {
-                if ((*child)->pos.last == 0) continue;
-                if (amaf_map[(*child)->pos.last] == amaf_map_value) {
+        // with their color. Only the children whose move has been played are
+        // visited: their index is the rank of their move in CHILD_MOVES()
+        int c = (n+k)%2, rank = 0;
+        children = __atomic_load_n(&node->children, __ATOMIC_ACQUIRE);
+        if (children != NULL) {
+            Bitboard *child_moves = CHILD_MOVES(children);
+            for (int i=0 ; i<BB_WORDS ; i++) {
+                unsigned long long m = child_moves->w[i];
+                for (unsigned long long b=m & res->played[c].w[i] ; b!=0 ;
+                                                                   b&=b-1) {
+                    int idx = rank + __builtin_popcountll(m & ((b&-b) - 1));
+                    TreeNode *child = &children[idx];
+                    int av = res->av[c][child->move];
+                    int aw = res->aw[c][child->move];
+                    assert(child->move == 64*i + __builtin_ctzll(b) && av > 0);
+                    if (flip) aw = av - aw;       // wins of the player to play
                     if (disp) {
                         char str[8];
-                        str_coord((*child)->pos.last, str);
-                        fprintf(stderr, "  AMAF updating %s %d\n", str,score>0);
+                        str_coord(child->move, str);
+                        fprintf(stderr, "  AMAF updating %s %d/%d\n",str,aw,av);
                     }
-                    (*child)->aw += score > 0; // reversed perspective
-                    (*child)->av += 1;
+                    if (aw > 0) __sync_fetch_and_add(&child->aw, aw);
+                    __sync_fetch_and_add(&child->av, av);
                 }
+                rank += __builtin_popcountll(m);
             }
         }
-        score = -score;
+        flip = !flip;
     }
 }
 
-Point tree_search(TreeNode *tree, int n, int owner_map[], int disp)
-// Perform MCTS search from a given position for a given #iterations
+//---------------------------- ownership statistics --------------------------
+// The final position of each playout of a search is added to the statistics
+// of its thread: owner_stats[k] is only written by the thread k of the search,
+// so that no lock or atomic operation is needed. The slots are summed when the
+// statistics are read (gtp final_score, final_status_list, ...) at no cost for
+// the search. The criticality of a point [Coulom 2009] is the probability
+// that it belongs to the winner minus this probability if the owner of the
+// point and the winner were independent: it is high for the points whose
+// owner decides the game.
+typedef struct {
+    int n;                    // number of playouts
+    int black_wins;           // number of playouts won by BLACK
+    int black[BOARDSIZE];     // number of playouts where the point is BLACK's
+    int white[BOARDSIZE];     // number of playouts where the point is WHITE's
+    int winner[BOARDSIZE];    // number of playouts where it is the winner's
+} OwnerStats;
+OwnerStats owner_stats[MAX_THREADS];    // last genmove search + its pondering
+
+double owner_stats_add(OwnerStats *o, Position *pos)
+// Add the final position pos of a playout to the statistics o, return its
+// score for the player to play (as score())
 {
-    double s;
-    int *amaf_map=calloc(BOARDSIZE, sizeof(int)), i, last;
-    TreeNode *best, *nodes[500];
+    Bitboard own, opp;
+    double   s = score_owners(pos, &own, &opp);
+    int      black = (pos->n%2 == 0);          // BLACK is to play
+    int      black_wins = (black ? s : -s) > 0;
+    Bitboard *bb = black ? &own : &opp, *bw = black ? &opp : &own;
+    for (int k=0 ; k<BB_WORDS ; k++) {
+        for (unsigned long long b=bb->w[k] ; b!=0 ; b&=b-1) {
+            Point pt = 64*k + __builtin_ctzll(b);
+            o->black[pt]++;
+            o->winner[pt] += black_wins;
+        }
+        for (unsigned long long b=bw->w[k] ; b!=0 ; b&=b-1) {
+            Point pt = 64*k + __builtin_ctzll(b);
+            o->white[pt]++;
+            o->winner[pt] += !black_wins;
+        }
+    }
+    o->black_wins += black_wins;
+    o->n++;
+    return s;
+}
 
-    // Initialize the root node if necessary
-    if (tree->children == NULL) expand(tree);
-    memset(owner_map,0,BOARDSIZE*sizeof(int));
-
-    for (i=0 ; i<n ; i++) {
-        memset(amaf_map, 0, BOARDSIZE*sizeof(int));
-        if (i>0 && i % REPORT_PERIOD == 0) print_tree_summary(tree, i, stderr);
-        last = tree_descend(tree, amaf_map, disp, nodes);
-        Position pos = nodes[last]->pos;
-        s = mcplayout(&pos, amaf_map, owner_map, disp);
-        tree_update(nodes, last, amaf_map, s, disp);
-        // Early stop test
-        double best_wr = winrate(best_move(tree, NULL));
-        if ( (i>n*0.05 && best_wr > FASTPLAY5_THRES)
-              || (i>n*0.2 && best_wr > FASTPLAY20_THRES)) break;
+void owner_stats_sum(OwnerStats *sum)
+// Sum of the statistics of all the threads (approximate if a search is running)
+{
+    memset(sum, 0, sizeof(OwnerStats));
+    for (int k=0 ; k<MAX_THREADS ; k++) {
+        OwnerStats *o = &owner_stats[k];
+        if (o->n == 0) continue;
+        sum->n += o->n;
+        sum->black_wins += o->black_wins;
+        FORALL_POINTS(pos, pt) {
+            sum->black[pt] += o->black[pt];
+            sum->white[pt] += o->white[pt];
+            sum->winner[pt] += o->winner[pt];
+        }
     }
-    dump_subtree(tree, N_SIMS/50, "", stderr, 1);
-    print_tree_summary(tree, i, stderr);
-    best = best_move(tree, NULL);
+}
+
+void owner_stats_map(int owner_map[])
+// Set owner_map (used by print_pos) from the statistics of the last search
+{
+    OwnerStats sum;
+    owner_stats_sum(&sum);
+    FORALL_POINTS(pos, pt) owner_map[pt] = sum.black[pt] - sum.white[pt];
+}
+
+double criticality(OwnerStats *o, Point pt)
+// Criticality of the point pt (o->n > 0)
+{
+    double n = o->n, pb = o->black_wins / n;
+    return o->winner[pt]/n - (o->black[pt]/n*pb + o->white[pt]/n*(1-pb));
+}
+
+typedef struct { // ------------ Data shared by the threads of a search -----
+    TreeNode     *tree;
+    Position     *pos;        // position at the root of the tree
+    int          n;           // number of simulations to perform
+    int          i;           // number of simulations started
+    int          i0;          // visits of the root at the start of the search
+    int          done;        // number of simulations completed
+    volatile int stop;        // set when the search can be stopped early
+    double       start;       // wall clock time at the start of the search
+    double       time_limit;  // duration of the search in seconds (0: none)
+    int          disp;
+    int          report;      // print a summary every REPORT_PERIOD sims
+} Search;
+
+typedef struct {
+    Search       *s;
+    OwnerStats   *owner;      // ownership statistics of the thread
+    Rng          rng;         // random generator of the thread
+} Worker;
+
+volatile int search_interrupts=0; // stop requests read by gtp_reader() and
+                                  // not yet processed: the searches stop
+
+double wall_time(void)
+// Elapsed time in seconds (unlike clock() it does not add the time of threads)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
 
-    free(amaf_map);
-    if (best->pos.last == PASS_MOVE && best->pos.last2 == PASS_MOVE)
+int can_stop(Search *s, int i)
+// Return 1 if the search can be stopped after i simulations
+{
+    double progress = (double) i / s->n;       // fraction of the search done
+    int    remaining = s->n - i;               // simulations that can be done
+    if (tree_arena->nnodes > MAX_TREE_NODES) return 1;    // memory is full
+    if (search_interrupts > 0) return 1;         // gtp stop or interrupt
+    if (s->time_limit > 0) {
+        double elapsed = wall_time() - s->start;
+        if (elapsed >= s->time_limit) return 1;
+        if (elapsed/s->time_limit > progress)
+            progress = elapsed/s->time_limit;
+        // remaining simulations estimated from the rate of this search
+        double rate = (s->done - s->i0 + 1) / elapsed;
+        if (rate*(s->time_limit - elapsed) < remaining)
+            remaining = rate*(s->time_limit - elapsed);
+    }
+    TreeNode *best[3] = {NULL, NULL, NULL};
+    best[0] = best_move(s->tree, NULL);
+    double best_wr = winrate(best[0]);
+    if ( (progress > 0.05 && best_wr > FASTPLAY5_THRES)
+          || (progress > 0.2 && best_wr > FASTPLAY20_THRES)) return 1;
+    // The best move cannot be overtaken by the second one
+    best[1] = best_move(s->tree, best);
+    return best[1] != NULL && best[0]->v - best[1]->v > remaining;
+}
+
+void search_loop(Search *s, OwnerStats *owner)
+// Perform simulations until the number of iterations of the search is reached
+// leaf_playouts playouts are run from each leaf reached by tree_descend() and
+// their results are stored in the tree at once
+{
+    int *amaf_map=calloc(BOARDSIZE, sizeof(int)), *amaf, i, last;
+    int *amaf_leaf=calloc(BOARDSIZE, sizeof(int));
+    int nleaf = leaf_playouts;
+    LeafResults *res = malloc(sizeof(LeafResults));
+    TreeNode *nodes[500];
+    Position leaf, pos, *ppos;
+
+    while (!s->stop && (i=__sync_fetch_and_add(&s->i, nleaf)) < s->n) {
+        memset(amaf_leaf, 0, BOARDSIZE*sizeof(int));
+        memset(res, 0, sizeof(LeafResults));
+        if (s->report && i>0 && i % REPORT_PERIOD < nleaf)
+            print_tree_summary(s->tree, i, stderr);
+        STATS_START(ST_SIMUL);
+        leaf = *s->pos;
+        STATS_START(ST_DESCEND);
+        last = tree_descend(s->tree, &leaf, amaf_leaf, nleaf, s->disp, nodes);
+        STATS_STOP(ST_DESCEND);
+        for (int k=0 ; k<nleaf ; k++) {
+            ppos = &leaf; amaf = amaf_leaf;   // used by the last playout
+            if (k < nleaf-1) {
+                pos = leaf; ppos = &pos;
+                memcpy(amaf_map, amaf_leaf, BOARDSIZE*sizeof(int));
+                amaf = amaf_map;
+            }
+            // mcplayout() whose final position is scored by owner_stats_add()
+            STATS_START(ST_PLAYOUT);
+            int start_n = ppos->n;
+            mcplayout_moves(ppos, amaf, s->disp);
+            double sc = owner_stats_add(owner, ppos);
+            if (start_n%2 != ppos->n%2) sc = -sc;
+            STATS_STOP(ST_PLAYOUT);
+            leaf_results_add(res, amaf, sc);
+        }
+        STATS_START(ST_UPDATE);
+        tree_update(nodes, last, s->pos->n, res, s->disp);
+        STATS_STOP(ST_UPDATE);
+        STATS_STOP(ST_SIMUL);
+        __sync_fetch_and_add(&s->done, nleaf);
+        if (can_stop(s, i+nleaf)) s->stop = 1;
+    }
+    free(amaf_map); free(amaf_leaf); free(res);
+}
+
+void* search_thread(void *arg)
+{
+    Worker *wk = arg;
+    thread_init(&wk->rng);
+    search_loop(wk->s, wk->owner);
+    thread_free();
+    return NULL;
+}
+
+Point root_move(TreeNode *tree)
+// Move chosen at the root of the tree after the search
+{
+    TreeNode *best = best_move(tree, NULL);
+
+    if (best->move == PASS_MOVE && root_pos.last == PASS_MOVE)
         return PASS_MOVE;
-    else if (((double) best->w / (double) best->v) < RESIGN_THRES)
+    else if (tree->v >= RESIGN_MIN_SIMS   // (the search may be interrupted)
+             && ((double) best->w / (double) best->v) < RESIGN_THRES)
         return RESIGN_MOVE;
     else
-        return best->pos.last;
+        return best->move;
+}
+
+Point tree_search(TreeNode *tree, int n, double time_limit, int owner_map[],
+                                                                    int disp)
+// Perform MCTS search from the position at the root of the tree (root_pos)
+// for a given #iterations (the visits of the root inherited from the previous
+// searches are counted) or, if time_limit > 0, for time_limit seconds
+// The current thread and nthreads-1 other threads share the same tree
+// The ownership of the points in the playouts is returned in owner_map
+{
+    Search    s = {tree, &root_pos, n, tree->v, tree->v, tree->v, 0,
+                   wall_time(), time_limit, disp, 1};
+    Worker    workers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+#ifndef NO_STATS
+    unsigned long long start_cycles = read_cycles();
+#endif
+
+    if (time_limit > 0) s.n = MAX_SIMS;
+
+    // Initialize the root node if necessary
+    if (tree->children == NULL) expand(tree, &root_pos);
+    memset(owner_stats, 0, sizeof(owner_stats));
+
+    for (int k=1 ; k<nthreads ; k++) {
+        workers[k].s = &s;
+        workers[k].owner = &owner_stats[k];
+        workers[k].rng = rng; rng_jump(&rng);
+        pthread_create(&threads[k], NULL, search_thread, &workers[k]);
+    }
+    search_loop(&s, &owner_stats[0]);
+    for (int k=1 ; k<nthreads ; k++)
+        pthread_join(threads[k], NULL);
+    owner_stats_map(owner_map);
+    STATS_INC(search_time, wall_time() - s.start);
+    STATS_INC(search_cycles, read_cycles() - start_cycles);
+    LOG_DEBUG("search: %d simulations in %.3f s, %d nodes", s.done - s.i0,
+                                    wall_time() - s.start, tree_arena->nnodes);
+
+    dump_subtree(tree, N_SIMS/50, "", stderr, 1);
+    print_tree_summary(tree, s.done, stderr);
+    return root_move(tree);
+}
+
+//-------------------------------- pondering ---------------------------------
+// After genmove, the tree of the position is searched by background threads
+// while gtp_io() waits for the next command (the move of the opponent). The
+// search is stopped when the command arrives, and the subtree of the move
+// played is kept by advance_tree().
+int       ponder_enabled=0;
+int       pondering=0;             // 1 if the background search is running
+Search    ponder_search;
+Worker    ponder_workers[MAX_THREADS];
+pthread_t ponder_threads[MAX_THREADS];
+unsigned long long ponder_start_cycles;
+
+void start_ponder(TreeNode *tree)
+{
+    Search s = {tree, &root_pos, MAX_SIMS, tree->v, tree->v, tree->v, 0,
+                wall_time(), 0, 0, 0};
+    if (tree->children == NULL) expand(tree, &root_pos);
+    ponder_search = s;
+    ponder_start_cycles = read_cycles();
+    for (int k=0 ; k<nthreads ; k++) {
+        ponder_workers[k].s = &ponder_search;
+        ponder_workers[k].owner = &owner_stats[k];
+        ponder_workers[k].rng = rng; rng_jump(&rng);
+        pthread_create(&ponder_threads[k], NULL, search_thread,
+                                                         &ponder_workers[k]);
+    }
+    pondering = 1;
+}
+
+void stop_ponder(void)
+{
+    if (!pondering) return;
+    ponder_search.stop = 1;
+    for (int k=0 ; k<nthreads ; k++)
+        pthread_join(ponder_threads[k], NULL);
+    pondering = 0;
+    STATS_INC(search_time, wall_time() - ponder_search.start);
+    STATS_INC(search_cycles, read_cycles() - ponder_start_cycles);
+    TreeNode *best = best_move(ponder_search.tree, NULL);
+    if (best == NULL) return;
+    char str[8];
+    sprintf(buf, "pondering: %d simulations, expected move %s",
+            ponder_search.done - ponder_search.i0, str_coord(best->move, str));
+    log_fmt_s('I', buf, NULL);
+}
+
+//---------------------------- root parallel search ---------------------------
+// genmove can be performed by several michi processes (on the same computer or
+// on other hosts) that search the same position independently, with different
+// seeds. Each worker process is a "michi gtp" started by the command given
+// with the option -w (ex: -w "./michi -l w1.log gtp" on the same computer or
+// -w "ssh host2 cd michi-c \; ./michi gtp" on another host). It
+// receives the position (michi-setpos) and the search to do (michi-root_search)
+// and replies with the visits and the wins of the children of its root, which
+// are added to the ones of the local search before choosing the move, and with
+// the ownership statistics of its playouts, added to the ones of the local
+// threads.
+//
+// Wire format (text, because it goes through gtp)
+//   position   : n ko last last2 cap capX board
+//                board = the N*N points row by row, seen by BLACK: . X O
+//   root stats : sims move:v:w move:v:w ... (the children with visits)
+//                ; n black_wins b,w,c b,w,c ... (OwnerStats of the N*N points)
+typedef struct {
+    FILE  *in, *out;           // gtp commands and replies
+    pid_t pid;
+} Process;
+int     nprocesses=0;           // number of worker processes
+char    *process_cmd[MAX_PROCESSES];
+Process processes[MAX_PROCESSES];
+
+char* encode_position(Position *pos, char *str)
+// Encode pos in str (wire format)
+{
+    char s1[8], s2[8], s3[8], *b;
+    sprintf(str, "%d %s %s %s %d %d ", pos->n, str_coord(pos->ko, s1),
+            str_coord(pos->last, s2), str_coord(pos->last2, s3),
+            pos->cap, pos->capX);
+    b = str + strlen(str);
+    FORALL_POINTS(pos, pt) {
+        char c = pos->color[pt];
+        if (c == ' ') continue;
+        if (c != '.') c = ((c == 'X') == (pos->n%2 == 0)) ? 'X' : 'O';
+        *b++ = c;
+    }
+    *b = 0;
+    return str;
+}
+
+char* decode_position(Position *pos, char *str)
+// Set pos from str (wire format). The stones are put down by a sequence of
+// moves (with passes) that does not capture, as it leads to a legal position.
+{
+    int  n, cap, capX, k=0;
+    char ko[8], last[8], last2[8], board[N*N+1], fmt[64];
+    sprintf(fmt, "%%d %%7s %%7s %%7s %%d %%d %%%ds", N*N);
+    if (sscanf(str, fmt, &n, ko, last, last2, &cap, &capX, board) != 7
+            || strlen(board) != N*N)
+        return "Error: bad position";
+    empty_position(pos);
+    for (int pass=0 ; pass<2 ; pass++)            // the BLACK stones first
+        for (k=0 ; k<N*N ; k++) {
+            Point pt = (k/N+1)*(N+1) + k%N + 1;
+            if (board[k] != (pass ? 'O' : 'X')) continue;
+            if ((pos->n%2 == 0) != (pass == 0)) pass_move(pos);
+            if (play_move(pos, pt)[0] != 0) return "Error: illegal position";
+        }
+    if (pos->n%2 != n%2) pass_move(pos);
+    pos->n = n; pos->cap = cap; pos->capX = capX;
+    pos->ko = parse_coord(ko);
+    pos->last = parse_coord(last);
+    pos->last2 = parse_coord(last2);
+    return "";
+}
+
+char* encode_root_stats(TreeNode *tree, char *str)
+// Encode the visits and the wins of the children of the root (wire format)
+{
+    char s[32], m[8];
+    sprintf(str, "%d", tree->v);
+    for (int k=0 ; k<tree->nchildren ; k++) {
+        TreeNode *node = &tree->children[k];
+        if (node->v == 0) continue;
+        sprintf(s, " %s:%d:%d", str_coord(node->move, m), node->v, node->w);
+        strcat(str, s);
+    }
+    return str;
+}
+
+char* encode_owner_stats(OwnerStats *o, char *str)
+// Encode the ownership statistics o in str (wire format)
+{
+    char *s = str + sprintf(str, "; %d %d", o->n, o->black_wins);
+    for (int k=0 ; k<N*N ; k++) {
+        Point pt = (k/N+1)*(N+1) + k%N + 1;
+        s += sprintf(s, " %d,%d,%d", o->black[pt], o->white[pt], o->winner[pt]);
+    }
+    return str;
+}
+
+void merge_owner_stats(OwnerStats *o, char *str)
+// Add the ownership statistics str (wire format) to o
+{
+    int n, black_wins, b, w, c, len;
+    if (sscanf(str, "; %d %d%n", &n, &black_wins, &len) != 2) return;
+    o->n += n; o->black_wins += black_wins;
+    for (int k=0 ; k<N*N ; k++) {
+        Point pt = (k/N+1)*(N+1) + k%N + 1;
+        if (sscanf(str += len, " %d,%d,%d%n", &b, &w, &c, &len) != 3) return;
+        o->black[pt] += b; o->white[pt] += w; o->winner[pt] += c;
+    }
+}
+
+int merge_root_stats(TreeNode *tree, char *str, int sign)
+// Add (sign=1) or subtract (sign=-1) the root stats str to the children of
+// the root, return the number of simulations of str
+{
+    char m[8];
+    int  sims=0, v, w, len;
+    if (sscanf(str, "%d%n", &sims, &len) != 1) return 0;
+    while (sscanf(str += len, " %7[^:]:%d:%d%n", m, &v, &w, &len) == 3) {
+        Point move = parse_coord(m);
+        for (int k=0 ; k<tree->nchildren ; k++)
+            if (tree->children[k].move == move) {
+                tree->children[k].v += sign*v;
+                tree->children[k].w += sign*w;
+            }
+    }
+    return sims;
+}
+
+int process_command(Process *p, char *cmd, char *reply, int len)
+// Send a gtp command to a worker process (reply=NULL: do not wait the reply)
+// Return 1 if successful
+{
+    if (cmd != NULL && (fprintf(p->out, "%s\n", cmd) < 0 || fflush(p->out)))
+        return 0;
+    if (reply == NULL) return 1;
+    // the reply is "= ..." followed by an empty line
+    char line[BUFLEN];
+    reply[0] = 0;
+    do {
+        if (fgets(reply, len, p->in) == NULL) return 0;
+    } while (reply[0] != '=' && reply[0] != '?');
+    do {
+        if (fgets(line, BUFLEN, p->in) == NULL) return 0;
+    } while (line[0] != '\n');
+    return reply[0] == '=';
+}
+
+void start_processes(void)
+// Start the worker processes (their stderr is discarded)
+{
+    char cmd[32], reply[BUFLEN];
+    signal(SIGPIPE, SIG_IGN);          // a dead worker must not kill michi
+    fflush(stdout); fflush(stderr);    // (not to be written by the children)
+    for (int k=0 ; k<nprocesses ; k++) {
+        int to[2], from[2];
+        if (pipe(to) != 0 || pipe(from) != 0) break;
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(to[0], 0); dup2(from[1], 1);
+            freopen("/dev/null", "w", stderr);
+            close(to[1]); close(from[0]);
+            execl("/bin/sh", "sh", "-c", process_cmd[k], (char *) NULL);
+            _exit(-1);                  // (the log buffer is the parent's)
+        }
+        close(to[0]); close(from[1]);
+        processes[k].pid = pid;
+        processes[k].out = fdopen(to[1], "w");
+        processes[k].in = fdopen(from[0], "r");
+        log_fmt_s('I', "worker process: %s", process_cmd[k]);
+        sprintf(cmd, "boardsize %d", N);    // the workers start at N_DEFAULT
+        process_command(&processes[k], cmd, reply, BUFLEN);
+    }
+}
+
+void stop_processes(void)
+{
+    for (int k=0 ; k<nprocesses ; k++) {
+        process_command(&processes[k], "quit", NULL, 0);
+        fclose(processes[k].out); fclose(processes[k].in);
+        waitpid(processes[k].pid, NULL, 0);
+    }
+}
+
+Point root_parallel_search(TreeNode *tree, int n, double time_limit,
+                                                            int owner_map[])
+// tree_search() performed by the current process and the worker processes
+{
+    char cmd[BUFLEN], str[BUFLEN], *stats[MAX_PROCESSES];
+    int  ok[MAX_PROCESSES], sims=0;
+
+    sprintf(cmd, "michi-setpos %s", encode_position(&root_pos, str));
+    for (int k=0 ; k<nprocesses ; k++) {
+        stats[k] = calloc(ROOT_STATS_LEN, 1);
+        ok[k] = process_command(&processes[k], cmd, str, BUFLEN);
+        sprintf(str, "michi-root_search %d %.3f %u", n, time_limit,
+                                                                  qdrandom());
+        ok[k] = ok[k] && process_command(&processes[k], str, NULL, 0);
+    }
+    tree_search(tree, n, time_limit, owner_map, 0);
+    for (int k=0 ; k<nprocesses ; k++) {
+        ok[k] = ok[k] && process_command(&processes[k], NULL, stats[k],
+                                                             ROOT_STATS_LEN);
+        char *own = strchr(stats[k], ';');
+        if (own != NULL) {
+            merge_owner_stats(&owner_stats[0], own);   // the search is over
+            *own = 0;
+        }
+        if (ok[k])
+            sims += merge_root_stats(tree, stats[k]+2, 1);
+        else
+            log_fmt_s('E', "worker process %s failed", process_cmd[k]);
+    }
+    log_fmt_i('I', "root parallel search: %d simulations by the workers",
+                                                                        sims);
+    owner_stats_map(owner_map);
+    Point move = root_move(tree);
+    // the tree is kept for the next search: its own statistics are restored
+    for (int k=0 ; k<nprocesses ; k++) {
+        if (ok[k]) merge_root_stats(tree, stats[k]+2, -1);
+        free(stats[k]);
+    }
+    return move;
 }
 
 //============================= user interface(s) =============================
@@ -1130,7 +2495,7 @@ void dump_subtree(TreeNode *node, double thres, char *indent, FILE *f
 // print this node and all its children with v >= thres.
 {
     char str[8], str_winrate[8], str_rave_winrate[8];
-    str_coord(node->pos.last, str);
+    str_coord(node->move, str);
     if (node->v) sprintf(str_winrate, "%.3f", winrate(node));
     else         sprintf(str_winrate, "nan");
     if (node->av) sprintf(str_rave_winrate, "%.3f", (double)node->aw/node->av);
@@ -1142,9 +2507,9 @@ void dump_subtree(TreeNode *node, double thres, char *indent, FILE *f
     if (recurse) {
         char new_indent[BUFLEN];
         sprintf(new_indent,"%s   ", indent);
-        for (TreeNode **child = node->children ; *child != NULL ; child++)
-            if ((*child)->v >= thres)
-                dump_subtree((*child), thres, new_indent, f, 0);
+        for (int k=0 ; k<node->nchildren ; k++)
+            if (node->children[k].v >= thres)
+                dump_subtree(&node->children[k], thres, new_indent, f, 0);
     }
 }
 
@@ -1157,7 +2522,7 @@ void print_tree_summary(TreeNode *tree, int sims, FILE *f)
     for (k=0 ; k<5 ; k++) {
         best_node[k] = best_move(tree, best_node);
         if (best_node[k] != NULL) {
-            str_coord(best_node[k]->pos.last,str);
+            str_coord(best_node[k]->move,str);
             if (best_node[k]->v)
                 sprintf(tmp, " %s(%.3f)", str, winrate(best_node[k]));
             else
@@ -1169,12 +2534,13 @@ void print_tree_summary(TreeNode *tree, int sims, FILE *f)
     for (k=0 ; k<5 ; k++) {
         node = best_move(node, NULL);
         if (node == NULL) break;
-        str_coord(node->pos.last, str);
+        str_coord(node->move, str);
         strcat(str, " ");
         strcat(best_seq, str);
     }
-    fprintf(f,"[%4d] winrate %.3f | seq %s| can %s\n",sims
-                                    ,winrate(best_node[0]), best_seq, can);
+    fprintf(f,"[%4d] winrate %.3f | seq %s| can %s| nodes %d (%.1f MB)\n",sims
+                ,winrate(best_node[0]), best_seq, can, tree_arena->nnodes
+                ,tree_arena->used/1048576.0);
 }
 
 Point parse_coord(char *s)
@@ -1274,29 +2640,524 @@ double mcbenchmark(int n, Position *pos, int amaf_map[], int owner_map[])
     return sumscore/n;
 }
 
-void begin_game(void) {
+int read_bench_position(FILE *f, Position *pos, char *name)
+// Read the next position of a benchmark file (name and moves on one line)
+// The line "boardsize SIZE" gives the size of the moves of the next lines.
+// Return 0 at the end of the file or if the size is not N
+{
+    char line[4096], *str, m[8];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || (str = strtok(line, " \t\n")) == NULL)
+            continue;
+        if (strcmp(str, "boardsize") == 0) {
+            str = strtok(NULL, " \t\n");
+            if (str != NULL && atoi(str) == N) continue;
+            fprintf(stderr, "the benchmark file is for boardsize %s, not %d\n",
+                                                 str ? str : "?", N);
+            return 0;
+        }
+        strncpy(name, str, 31); name[31] = 0;
+        empty_position(pos);
+        while ((str = strtok(NULL, " \t\n")) != NULL) {
+            Point pt = parse_coord(str);
+            if (pt != PASS_MOVE && (pt >= BOARDSIZE || pos->color[pt] == ' '
+                          || strcasecmp(str_coord(pt, m), str) != 0)) {
+                fprintf(stderr, "%s: bad move %s for N=%d\n", name, str, N);
+                return 0;
+            }
+            char *ret = (pt == PASS_MOVE) ? pass_move(pos) : play_move(pos, pt);
+            if (ret[0] != 0) {
+                fprintf(stderr, "%s: illegal move %s\n", name, str);
+                break;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void benchmark(char *filename, unsigned int seed)
+// Run the playout-only, expansion-only and search-only workloads on each
+// position of the file and print the results (one line "key=value ..." per
+// workload and position). The random generator is seeded with seed before
+// each workload so that the work done is the same for all the builds.
+{
+    char     name[32];
+    int      amaf_map[BOARDSIZE], owner_map[BOARDSIZE];
+    Position pos, pos2;
+    struct rusage ru;
+    FILE     *f = fopen(filename, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return;
+    }
+    printf("benchmark=%s seed=%u threads=%d N=%d\n", filename, seed,
+                                                           nthreads, N);
+    while (read_bench_position(f, &pos, name)) {
+        // playouts
+        long long nmoves = 0;
+        rng_seed(&rng, seed);
+        double start = wall_time();
+        for (int i=0 ; i<BENCH_PLAYOUTS ; i++) {
+            pos2 = pos; memset(amaf_map, 0, sizeof(amaf_map));
+            mcplayout(&pos2, amaf_map, owner_map, 0);
+            nmoves += pos2.n - pos.n;
+        }
+        double t = wall_time() - start;
+        printf("position=%s workload=playout playouts=%d time=%.3lf "
+               "playouts_per_s=%.0lf ns_per_move=%.0lf\n", name,
+               BENCH_PLAYOUTS, t, BENCH_PLAYOUTS/t, 1e9*t/nmoves);
+
+        // expansion of the root node
+        rng_seed(&rng, seed);
+        start = wall_time();
+        int nchildren = 0;
+        for (int i=0 ; i<BENCH_EXPANDS ; i++) {
+            TreeNode *tree = new_tree(&pos);
+            pos2 = pos;
+            expand(tree, &pos2);
+            nchildren = tree->nchildren;
+        }
+        t = wall_time() - start;
+        printf("position=%s workload=expand expands=%d time=%.3lf "
+               "us_per_expand=%.1lf children=%d\n", name, BENCH_EXPANDS, t,
+               1e6*t/BENCH_EXPANDS, nchildren);
+
+        // tree search (from the tree of the position only)
+        rng_seed(&rng, seed);
+        TreeNode *tree = new_tree(&pos);
+        start = wall_time();
+        tree_search(tree, BENCH_SIMS, 0, owner_map, 0);
+        t = wall_time() - start;
+        printf("position=%s workload=search sims=%d time=%.3lf "
+               "sims_per_s=%.0lf nodes=%d nodes_per_s=%.0lf\n", name,
+               tree->v, t, tree->v/t, tree_arena->nnodes,
+               tree_arena->nnodes/t);
+    }
+    fclose(f);
+    getrusage(RUSAGE_SELF, &ru);
+    printf("peak_rss_kb=%ld\n", ru.ru_maxrss);
+}
+
+// Binary records written by "michi selfplay" (native byte order). Each game
+// is a SelfplayGame header followed by nmoves move records. A move record is
+// a SelfplayMove followed by npats pattern ids (int, the ids of patterns.spat
+// of the large patterns that match at the move played) and nvisits
+// SelfplayVisit (visits of the children of the root after the search).
+typedef struct {
+    char   magic[4];          // "MSP1"
+    int    size;              // board size N
+    int    nmoves;            // number of move records
+    int    winner;            // 1: black, -1: white, 0: no result
+    float  komi;
+    float  score;             // score for black of the final position or 0
+} SelfplayGame;
+
+typedef struct {
+    ZobristHash key;          // position_key() before the move
+    Point  move;              // move played (PASS_MOVE or RESIGN_MOVE)
+    short  npats;             // number of pattern ids that follow
+    short  nvisits;           // number of SelfplayVisit that follow
+} SelfplayMove;
+
+typedef struct {
+    Point  move;              // child of the root
+    int    v;                 // its number of visits
+} SelfplayVisit;
+
+#define SELFPLAY_MOVE_MAX (sizeof(SelfplayMove) + 12*sizeof(int) \
+                                          + (N*N+1)*sizeof(SelfplayVisit))
+
+int selfplay_record(char *p, Position *pos, TreeNode *tree, Point move)
+// Write in p the record of move played in pos after the search of tree,
+// return its size (the records are not aligned in the buffer)
+{
+    int           ids[12];
+    SelfplayVisit vis[N*N+1];
+    SelfplayMove  m = {position_key(pos), move, 0, tree->nchildren};
+    if (move != PASS_MOVE && move != RESIGN_MOVE) {
+        copy_to_large_board(pos);
+        m.npats = large_pattern_ids(move, ids);
+    }
+    for (int k=0 ; k<tree->nchildren ; k++) {
+        vis[k].move = tree->children[k].move;
+        vis[k].v = tree->children[k].v;
+    }
+    memcpy(p, &m, sizeof(m));
+    memcpy(p + sizeof(m), ids, m.npats*sizeof(int));
+    memcpy(p + sizeof(m) + m.npats*sizeof(int), vis,
+                                            m.nvisits*sizeof(SelfplayVisit));
+    return sizeof(m) + m.npats*sizeof(int) + m.nvisits*sizeof(SelfplayVisit);
+}
+
+void selfplay(int ngames, char *filename)
+// Play ngames games against itself (N_SIMS simulations per move with the
+// threads of the tree search) and write their records in the file (stdout if
+// filename is "-"). The records of a game are buffered and written at once
+// when the game is over.
+{
+    int          owner_map[BOARDSIZE];
+    char         *buffer = malloc(MAX_GAME_LEN*SELFPLAY_MOVE_MAX);
+    Position     pos;
+    SelfplayGame g;
+    FILE         *f = stdout;
+
+    if (strcmp(filename, "-") != 0 && (f = fopen(filename, "wb")) == NULL) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        free(buffer);
+        return;
+    }
+    for (int i=0 ; i<ngames ; i++) {
+        int  len = 0;
+        begin_game();
+        empty_position(&pos);
+        TreeNode *tree = new_tree(&pos);
+        memset(&g, 0, sizeof(g));
+        memcpy(g.magic, "MSP1", 4);
+        g.size = N; g.komi = pos.komi;
+        while (pos.n < MAX_GAME_LEN) {
+            Point pt = tree_search(tree, N_SIMS, 0, owner_map, 0);
+            len += selfplay_record(buffer+len, &pos, tree, pt);
+            g.nmoves++;
+            if (pt == RESIGN_MOVE) {       // the player to play resigns
+                g.winner = (pos.n%2 == 0 ? -1 : 1);
+                break;
+            }
+            int end = (pt == PASS_MOVE && pos.last == PASS_MOVE);
+            if (pt == PASS_MOVE) pass_move(&pos);
+            else                 play_move(&pos, pt);
+            if (end) {
+                double sc = score(&pos, owner_map);
+                g.score = (pos.n%2 == 0 ? sc : -sc);
+                g.winner = (g.score > 0 ? 1 : -1);
+                break;
+            }
+            tree = advance_tree(tree, pt, &pos);
+        }
+        fwrite(&g, sizeof(g), 1, f);
+        fwrite(buffer, len, 1, f);
+        fflush(f);
+        log_fmt_i('I', "selfplay: %d games written", i+1);
+    }
+    if (f != stdout) fclose(f);
+    free(buffer);
+}
+
+//------------------------------ time management ------------------------------
+// Clocks of the two players (0: black, 1: white). main_time < 0 means that
+// there is no time limit, the search then performs N_SIMS simulations.
+// stones_left > 0 means that the player is in a byo-yomi period of time_left
+// seconds for stones_left moves.
+double main_time=-1, byo_time=0;
+int    byo_stones=0;
+double time_left[2];
+int    stones_left[2];
+
+void set_time_settings(double main, double byo, int stones)
+{
+    main_time = main; byo_time = byo; byo_stones = stones;
+    if (byo > 0 && stones == 0) main_time = -1;     // GTP: no time limit
+    for (int c=0 ; c<2 ; c++) {
+        time_left[c] = main;
+        stones_left[c] = 0;
+    }
+    if (main == 0)                                  // byo-yomi only
+        for (int c=0 ; c<2 ; c++) {
+            time_left[c] = byo;
+            stones_left[c] = stones;
+        }
+}
+
+double time_for_move(Position *pos, int c)
+// Return the time given to the search of the next move of color c (0 if the
+// game is not played with a time limit)
+{
+    double t;
+    if (main_time < 0) return 0;
+    // TIME_MARGIN is kept on the clock for the lag of the communications
+    if (stones_left[c] > 0)
+        t = (time_left[c] - TIME_MARGIN) / stones_left[c];
+    else {
+        // share the main time between the moves that remain to be played
+        // (estimated from the number of empty points) and use the byo-yomi
+        int nmoves = 0;
+        FORALL_POINTS(pos, pt)
+            if (pos->color[pt] == '.') nmoves++;
+        nmoves /= 3;
+        if (nmoves < TIME_MOVES_MIN) nmoves = TIME_MOVES_MIN;
+        t = (time_left[c] - TIME_MARGIN) / nmoves;
+        if (byo_stones > 0) t += (byo_time - TIME_MARGIN) / byo_stones;
+    }
+    if (t < 0.1) t = 0.1;
+    return t;
+}
+
+void update_clock(int c, double elapsed)
+// Update the clock of color c after a move that took elapsed seconds
+// (the clock is overridden by the GTP command time_left if the controller
+// sends it)
+{
+    if (main_time < 0) return;
+    time_left[c] -= elapsed;
+    if (stones_left[c] > 0) {
+        if (--stones_left[c] == 0) {                // new byo-yomi period
+            time_left[c] = byo_time;
+            stones_left[c] = byo_stones;
+        }
+    }
+    else if (time_left[c] <= 0 && byo_stones > 0) {  // end of the main time
+        time_left[c] = byo_time;
+        stones_left[c] = byo_stones;
+    }
+}
+
+char* gtp_time_settings(void)
+// GTP commands time_settings and kgs-time_settings (arguments after command)
+{
+    char *str = strtok(NULL, " \t\n");
+    double main, byo=0;
+    int stones=0;
+    if (str == NULL) return "Error missing argument";
+    if (strcmp(str, "none") == 0) {
+        main_time = -1;
+        return "";
+    }
+    if (strcmp(str, "absolute") == 0 || strcmp(str, "byoyomi") == 0
+                                     || strcmp(str, "canadian") == 0) {
+        char *sys = str, *args[3] = {"0", "0", "0"};
+        for (int k=0 ; k<3 && (str = strtok(NULL, " \t\n")) != NULL ; k++)
+            args[k] = str;
+        main = atof(args[0]);
+        if (strcmp(sys, "byoyomi") == 0) {
+            // japanese byo-yomi: as many periods of 1 stone (the periods
+            // beyond the first one are kept as a safety margin)
+            byo = atof(args[1]); stones = 1;
+        }
+        else if (strcmp(sys, "canadian") == 0) {
+            byo = atof(args[1]); stones = atoi(args[2]);
+        }
+    }
+    else {
+        main = atof(str);
+        if ((str = strtok(NULL, " \t\n")) != NULL) byo = atof(str);
+        if ((str = strtok(NULL, " \t\n")) != NULL) stones = atoi(str);
+    }
+    set_time_settings(main, byo, stones);
+    sprintf(buf, "time settings: main %.0f s, byo-yomi %.0f s / %d stones",
+                                                          main, byo, stones);
+    log_fmt_s('I', buf, NULL);
+    return "";
+}
+
+int parse_color(char *str)
+// Return 0 for black, 1 for white
+{
+    return (str != NULL && (str[0] == 'w' || str[0] == 'W'));
+}
+
+//------------------- gtp commands on the ownership statistics ----------------
+// They read the statistics of the playouts of the last search (genmove or
+// pondering) and do not perform any playout.
+char* gtp_final_score(Position *pos, char *str)
+// Mean score of BLACK at the end of the playouts
+{
+    OwnerStats o;
+    owner_stats_sum(&o);
+    if (o.n == 0) return "Error: no search statistics (genmove first)";
+    double s = -pos->komi;
+    FORALL_POINTS(pos, pt) s += (double) (o.black[pt] - o.white[pt]) / o.n;
+    if (s > 0)      sprintf(str, "B+%.1f", s);
+    else if (s < 0) sprintf(str, "W+%.1f", -s);
+    else            strcpy(str, "0");
+    return str;
+}
+
+char* gtp_final_status_list(Position *pos, char *status, char *str)
+// The stones whose point belongs to the opponent at the end of more than half
+// of the playouts are dead, the others alive (seki is not recognized: its
+// list is empty)
+{
+    OwnerStats o;
+    char *s = str, m[8];
+    if (status == NULL || (strcmp(status, "alive") != 0
+               && strcmp(status, "dead") != 0 && strcmp(status, "seki") != 0))
+        return "Error: status must be alive, dead or seki";
+    owner_stats_sum(&o);
+    if (o.n == 0) return "Error: no search statistics (genmove first)";
+    *s = 0;
+    if (strcmp(status, "seki") == 0) return str;
+    FORALL_POINTS(pos, pt) {
+        char c = pos->color[pt];
+        if (c != 'X' && c != 'x') continue;
+        int black = (c == 'X') == (pos->n%2 == 0);
+        int dead = 2*(black ? o.white[pt] : o.black[pt]) > o.n;
+        if (dead == (status[0] == 'd'))
+            s += sprintf(s, "%s%s", s == str ? "" : " ", str_coord(pt, m));
+    }
+    return str;
+}
+
+char* gtp_owner_board(int crit, char *str)
+// gogui dboard of the ownership of the points (1: BLACK, -1: WHITE) or of
+// their criticality (crit=1)
+{
+    OwnerStats o;
+    char *s = str;
+    owner_stats_sum(&o);
+    if (o.n == 0) return "Error: no search statistics (genmove first)";
+    for (int row=1 ; row<=N ; row++) {
+        if (row > 1) *s++ = '\n';
+        for (int col=1 ; col<=N ; col++) {
+            Point pt = row*(N+1) + col;
+            double v = crit ? criticality(&o, pt)
+                            : (double) (o.black[pt] - o.white[pt]) / o.n;
+            s += sprintf(s, "%s%.2f", col > 1 ? " " : "", v);
+        }
+    }
+    *s = 0;
+    return str;
+}
+
+unsigned int game_seed;     // seed of the next game (the first one is -z SEED)
+
+void begin_game(void)
+// The game can be replayed with the option -z and the seed that is logged
+// (same size and settings): its random generator is seeded as at the start
+{
     c1++; c2=1;
-    sprintf(buf,"BEGIN GAME %d, random seed = %u",c1,idum);
+    unsigned int seed = game_seed;
+    game_seed = game_seed*1664525 + 1013904223;     // seed of the next game
+    if (game_seed == 0) game_seed = 1;              // (-z0: a random seed)
+    rng_seed(&rng, seed);
+    sprintf(buf,"BEGIN GAME %d, random seed = %u",c1,seed);
     log_fmt_s('I', buf, NULL);
 }
 
-void gtp_io(void)
+//------------------------------ gtp command reader ---------------------------
+// The gtp commands are read on stdin by a reader thread and queued, so that
+// the controller can send several commands without waiting for the replies
+// and so that a command can be seen while the engine is busy. The command
+// "stop" and the gogui interrupt (comment line "# interrupt") stop the search
+// in progress as soon as they are read: genmove then plays the best move
+// found so far, and the pondering ends.
+// The reader stops after the command quit or boardsize of another size: the
+// next commands are read by the reader of the engine of this size.
+#define GTP_QUEUE_SIZE 64
+struct {
+    char line[GTP_QUEUE_SIZE][BUFLEN];
+    int  first, n;                // first line and number of lines queued
+    int  eof;                     // set when the reader has stopped
+    pthread_mutex_t mutex;
+    pthread_cond_t  not_empty, not_full;
+} gtp_queue = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+               .not_empty = PTHREAD_COND_INITIALIZER,
+               .not_full = PTHREAD_COND_INITIALIZER};
+
+char* gtp_command_name(char *line, char *name, char **args)
+// Copy in name the command of the line (without its id), set args to the
+// arguments of the command
+{
+    int n = 0;
+    if (sscanf(line, " %*[0-9] %s%n", name, &n) != 1
+                                     && sscanf(line, " %s%n", name, &n) != 1)
+        name[0] = 0;
+    *args = line + n;
+    return name;
+}
+
+int is_interrupt(char *line)
+{
+    char name[BUFLEN], *args;
+    return strncmp(line, "# interrupt", 11) == 0
+        || strcmp(gtp_command_name(line, name, &args), "stop") == 0;
+}
+
+int is_last_command(char *line)
+// Return 1 if the engine stops reading stdin after this command
+{
+    char name[BUFLEN], *args;
+    int  size;
+    gtp_command_name(line, name, &args);
+    if (strcmp(name, "quit") == 0) return 1;
+    return strcmp(name, "boardsize") == 0 && sscanf(args, "%d", &size) == 1
+        && size != N && IS_BOARD_SIZE(size);
+}
+
+void* gtp_reader(void *arg)
+{
+    char line[BUFLEN];
+    int  last = 0;
+    while (!last && fgets(line, BUFLEN, stdin) != NULL) {
+        if (is_interrupt(line)) __sync_fetch_and_add(&search_interrupts, 1);
+        last = is_last_command(line);
+        pthread_mutex_lock(&gtp_queue.mutex);
+        while (gtp_queue.n == GTP_QUEUE_SIZE)
+            pthread_cond_wait(&gtp_queue.not_full, &gtp_queue.mutex);
+        strcpy(gtp_queue.line[(gtp_queue.first + gtp_queue.n++)
+                                                     % GTP_QUEUE_SIZE], line);
+        pthread_cond_signal(&gtp_queue.not_empty);
+        pthread_mutex_unlock(&gtp_queue.mutex);
+    }
+    pthread_mutex_lock(&gtp_queue.mutex);
+    gtp_queue.eof = 1;
+    pthread_cond_signal(&gtp_queue.not_empty);
+    pthread_mutex_unlock(&gtp_queue.mutex);
+    return NULL;
+}
+
+int gtp_read(char *line)
+// Wait for the next command line, return 0 at the end of the input
+{
+    pthread_mutex_lock(&gtp_queue.mutex);
+    while (gtp_queue.n == 0 && !gtp_queue.eof)
+        pthread_cond_wait(&gtp_queue.not_empty, &gtp_queue.mutex);
+    int ok = gtp_queue.n > 0;
+    if (ok) {
+        strcpy(line, gtp_queue.line[gtp_queue.first]);
+        gtp_queue.first = (gtp_queue.first + 1) % GTP_QUEUE_SIZE;
+        gtp_queue.n--;
+        pthread_cond_signal(&gtp_queue.not_full);
+    }
+    pthread_mutex_unlock(&gtp_queue.mutex);
+    if (ok && is_interrupt(line))        // its search is over
+        __sync_fetch_and_sub(&search_interrupts, 1);
+    return ok;
+}
+
+int gtp_io(void)
+// Answer the gtp commands read on stdin. Return 0 at the end of the session or
+// the new board size when the command boardsize asks for another size (the
+// session goes on with the engine built for this size, see main.c)
 {
     char line[BUFLEN], *cmdid, *command, msg[BUFLEN], *ret;
     char *known_commands="\nboardsize\ncputime\ndebug subcmd\ngenmove\nhelp\nknown_command"
-    "\nkomi\nlist_commands\nname\nplay\nprotocol_version\nquit\nversion\n";
-    int      game_ongoing=1, i;
+    "\nkgs-time_settings\nkomi\nlist_commands\nname\nplay\nprotocol_version\nquit"
+    "\nstop\nthreads\ntime_left\ntime_settings\nversion\ngogui-interrupt"
+    "\nfinal_score\nfinal_status_list\ngogui-analyze_commands"
+    "\nmichi-ownership\nmichi-criticality\nmichi-setpos\nmichi-root_search\n";
+    char *analyze_commands="dboard/Ownership/michi-ownership"
+    "\ndboard/Criticality/michi-criticality\nstring/Final Score/final_score"
+    "\nplist/Dead Stones/final_status_list dead";
+    int      game_ongoing=1, i, ponder_next, next_size=0;
     int      *owner_map=calloc(BOARDSIZE, sizeof(int));
+    char     *stats_buf=calloc(ROOT_STATS_LEN, 1);
     TreeNode *tree;
     Position *pos, pos2;
+    pthread_t reader;
 
     pos = &pos2;
     empty_position(pos);
-    tree = new_tree_node(pos);
+    tree = new_tree(pos);
+    // the diagnostics are written on stderr (buffered, see main.c) once the
+    // reply has been sent
+    gtp_queue.first = gtp_queue.n = gtp_queue.eof = 0;
+    pthread_create(&reader, NULL, gtp_reader, NULL);
 
     for(;;) {
-        ret = "";
-        if (fgets(line, BUFLEN, stdin) == NULL) break;
+        ret = ""; ponder_next = 0;
+        if (!gtp_read(line)) break;
+        stop_ponder();
         line[strlen(line)-1] = 0;
         log_fmt_s('C', line, NULL);
         command = strtok(line, " \t\n");
@@ -1321,23 +3182,37 @@ void gtp_io(void)
                 if(pt == PASS_MOVE) ret = pass_move(pos);
                 else ret ="Error Illegal move: point not EMPTY\n";
             }
+            if (ret[0] == 0) tree = advance_tree(tree, pt, pos);
         }
         else if (strcmp(command, "genmove") == 0) {
             c2++; game_ongoing = 1;
             Point pt;
+            int color = parse_color(strtok(NULL, " \t\n"));
+            double start = wall_time();
             if (pos->last == PASS_MOVE && pos->n>2) {
                 log_fmt_s('I', "Opponent pass. I pass", NULL);
                 pt = PASS_MOVE;
             }
             else {
-                free_tree(tree);
-                tree = new_tree_node(pos);
-                pt = tree_search(tree, N_SIMS, owner_map, 0);
+                // the tree may be out of date (after debug setpos for ex.)
+                if (!same_position(&root_pos, pos)) tree = new_tree(pos);
+                double t = time_for_move(pos, color);
+                if (t > 0) {
+                    sprintf(msg, "time for the move %.2f s", t);
+                    log_fmt_s('I', msg, NULL);
+                }
+                if (nprocesses > 0)
+                    pt = root_parallel_search(tree, N_SIMS, t, owner_map);
+                else
+                    pt = tree_search(tree, N_SIMS, t, owner_map, 0);
             }
             if (pt == PASS_MOVE)
                 pass_move(pos);
             else if (pt != RESIGN_MOVE)
                 play_move(pos, pt);
+            if (pt != RESIGN_MOVE) tree = advance_tree(tree, pt, pos);
+            update_clock(color, wall_time() - start);
+            ponder_next = ponder_enabled && pt != RESIGN_MOVE;
             ret = str_coord(pt, buf);
         }
         else if (strcmp(command, "cputime") == 0) {
@@ -1348,22 +3223,26 @@ void gtp_io(void)
         else if (strcmp(command, "clear_board") == 0) {
             if (game_ongoing) begin_game();
             game_ongoing = 0;
-            free_tree(tree);
             ret = empty_position(pos);
-            tree = new_tree_node(pos);
+            tree = new_tree(pos);
+            memset(owner_stats, 0, sizeof(owner_stats));
+            if (main_time >= 0)                 // reset the clocks
+                set_time_settings(main_time, byo_time, byo_stones);
         }
         else if (strcmp(command, "boardsize") == 0) {
             char *str = strtok(NULL, " \t\n");
             if(str == NULL) goto finish_command;
             int size = atoi(str);
-            if (size != N) {
+            if (size != N && !IS_BOARD_SIZE(size)) {
                 sprintf(buf, "Error: Trying to set incompatible boardsize %s"
-                             " (!= %d)", str, N);
+                             " (not in " BOARD_SIZES ")", str);
                 log_fmt_s('E', buf, NULL);
                 ret = buf;
             }
-            else
+            else {
+                if (size != N) next_size = size;
                 ret = "";
+            }
         }
         else if (strcmp(command, "komi") == 0) {
             char *str = strtok(NULL, " \t\n");
@@ -1378,6 +3257,63 @@ void gtp_io(void)
             else
                 ret = "";
         }
+        else if (strcmp(command, "time_settings") == 0
+                 || strcmp(command, "kgs-time_settings") == 0)
+            ret = gtp_time_settings();
+        else if (strcmp(command, "time_left") == 0) {
+            int c = parse_color(strtok(NULL, " \t\n"));
+            char *t = strtok(NULL, " \t\n"), *stones = strtok(NULL, " \t\n");
+            if (stones == NULL) goto finish_command;
+            time_left[c] = atof(t);
+            stones_left[c] = atoi(stones);
+            ret = "";
+        }
+        else if (strcmp(command, "threads") == 0) {
+            char *str = strtok(NULL, " \t\n");
+            if(str == NULL) goto finish_command;
+            int n = atoi(str);
+            if (n < 1 || n > MAX_THREADS) {
+                sprintf(buf, "Error: number of threads must be in 1..%d",
+                                                                 MAX_THREADS);
+                ret = buf;
+            }
+            else {
+                nthreads = n;
+                log_fmt_i('I', "tree search uses %d threads", nthreads);
+                ret = "";
+            }
+        }
+        else if (strcmp(command, "michi-setpos") == 0) {
+            char *str = strtok(NULL, "\n");
+            if (str == NULL) goto finish_command;
+            ret = decode_position(pos, str);
+            tree = new_tree(pos);
+        }
+        else if (strcmp(command, "michi-root_search") == 0) {
+            // root parallel search by a worker process: reply its root stats
+            char *n = strtok(NULL, " \t\n"), *t = strtok(NULL, " \t\n");
+            char *seed = strtok(NULL, " \t\n");
+            if (seed == NULL) goto finish_command;
+            rng_seed(&rng, strtoul(seed, NULL, 10));
+            if (!same_position(&root_pos, pos)) tree = new_tree(pos);
+            tree_search(tree, atoi(n), atof(t), owner_map, 0);
+            OwnerStats sum;
+            owner_stats_sum(&sum);
+            ret = encode_root_stats(tree, stats_buf);
+            encode_owner_stats(&sum, stats_buf + strlen(stats_buf));
+        }
+        else if (strcmp(command, "final_score") == 0)
+            ret = gtp_final_score(pos, stats_buf);
+        else if (strcmp(command, "final_status_list") == 0)
+            ret = gtp_final_status_list(pos, strtok(NULL, " \t\n"), stats_buf);
+        else if (strcmp(command, "michi-ownership") == 0)
+            ret = gtp_owner_board(0, stats_buf);
+        else if (strcmp(command, "michi-criticality") == 0)
+            ret = gtp_owner_board(1, stats_buf);
+        else if (strcmp(command, "gogui-analyze_commands") == 0)
+            ret = analyze_commands;
+        else if (strcmp(command, "stop") == 0)
+            ret = "";                   // the search has been stopped
         else if (strcmp(command,"debug") == 0)
             ret = debug(pos);
         else if (strcmp(command,"name") == 0)
@@ -1400,6 +3336,7 @@ void gtp_io(void)
         else if (strcmp(command,"quit") == 0) {
             printf("=%s \n\n", cmdid);
             log_hashtable_synthesis();
+            log_stats();
             break;
         }
         else {
@@ -1408,63 +3345,151 @@ void gtp_io(void)
         }
         print_pos(pos, stderr, owner_map);
 finish_command:
-        if ((ret[0]=='E' && ret[1]=='r')
-                        || ret[0]=='W') printf("\n?%s %s\n\n", cmdid, ret);
-        else                            printf("\n=%s %s\n\n", cmdid, ret);
+        if ((ret[0]=='E' && ret[1]=='r')            // Error or Warning (not
+                || (ret[0]=='W' && ret[1]=='a'))    // final_score W+...)
+            printf("\n?%s %s\n\n", cmdid, ret);
+        else
+            printf("\n=%s %s\n\n", cmdid, ret);
         fflush(stdout);
+        fflush(stderr);
+        if (next_size) break;
+        if (ponder_next) start_ponder(tree);
+    }
+    stop_ponder();
+    pthread_join(reader, NULL);
+    fflush(stderr);
+    free(stats_buf); free(owner_map);
+    return next_size;
+}
+
+void save_session(Session *session)
+// Save the state of the gtp session for the engine of the next board size
+{
+    session->restart = 1;
+    session->nthreads = nthreads;
+    session->main_time = main_time; session->byo_time = byo_time;
+    session->byo_stones = byo_stones;
+    for (int c=0 ; c<2 ; c++) {
+        session->time_left[c] = time_left[c];
+        session->stones_left[c] = stones_left[c];
+    }
+    session->c1 = c1; session->c2 = c2;
+    session->game_seed = game_seed;
+}
+
+void restore_session(Session *session)
+// Go on with the gtp session of the engine of another board size
+{
+    nthreads = session->nthreads;
+    main_time = session->main_time; byo_time = session->byo_time;
+    byo_stones = session->byo_stones;
+    for (int c=0 ; c<2 ; c++) {
+        time_left[c] = session->time_left[c];
+        stones_left[c] = session->stones_left[c];
     }
+    c1 = session->c1; c2 = session->c2;
+    game_seed = session->game_seed;
 }
 
-int michi_console(int argc, char *argv[])
+int michi_console(int argc, char *argv[], Session *session)
+// Run the command of the command line. session->restart is set when this
+// engine takes over a gtp session from the engine of another board size.
+// Return 0 or the board size of the engine that must go on with the session.
 {
-    char *command;
+    char *command, *logfile="michi.log";
+    int  next_size = 0;
+    unsigned int seed = 1;
+    Rng  r;
+    for (int k=1 ; k<argc-2 ; k++) {    // the log is needed by the init
+        if (strcmp(argv[k], "-l") == 0) logfile = argv[k+1];
+        if (strcmp(argv[k], "-L") == 0) log_types = argv[k+1];
+    }
     // Init global data
-    flog = fopen("michi.log", "w");
-    setbuf(flog, NULL);                // guarantees that log is unbuffered
+    log_open(logfile, session->restart);
     make_pat3set();
     init_large_patterns();
-    already_suggested = calloc(1, sizeof(Mark));
-    mark1 = calloc(1, sizeof(Mark)); mark2 = calloc(1, sizeof(Mark));
+    init_zobrist_board();
+    rng_seed(&r, seed);
+    thread_init(&r);
     Position *pos = malloc(sizeof(Position));
     int      *amaf_map=calloc(BOARDSIZE, sizeof(int));
     int      *owner_map=calloc(BOARDSIZE, sizeof(int));
     empty_position(pos);
-    TreeNode *tree = new_tree_node(pos);
-    expand(tree);
+    TreeNode *tree = new_tree(pos);
+    expand(tree, pos);
     slist_clear(allpoints);
     FORALL_POINTS(pos,pt)
         if (pos->color[pt] == '.') slist_push(allpoints,pt);
 
-    // check if the user gave a seed for the random generator
-    if (argc == 3) {
-        sscanf(argv[1], "-z%u", &idum);
-        if (idum == 0)
-            idum = true_random_seed();
-        command = argv[2];
+    // check if the user gave a seed for the random generator or a number of
+    // threads for the tree search
+    int k;
+    nprocesses = 0;
+    for (k=1 ; k<argc-1 && argv[k][0] == '-' ; k++) {
+        if (sscanf(argv[k], "-z%u", &seed) == 1) {
+            if (seed == 0)
+                seed = true_random_seed();
+        }
+        else if (strcmp(argv[k], "-p") == 0)
+            ponder_enabled = 1;
+        else if ((strcmp(argv[k], "-l") == 0 || strcmp(argv[k], "-L") == 0)
+                                                            && k+1 < argc-1)
+            k++;                            // already used
+        else if (strcmp(argv[k], "-w") == 0 && k+1 < argc-1) {
+            if (nprocesses == MAX_PROCESSES) usage();
+            process_cmd[nprocesses++] = argv[++k];
+        }
+        else if (sscanf(argv[k], "-t%d", &nthreads) == 1) {
+            if (nthreads < 1 || nthreads > MAX_THREADS) usage();
+        }
+        else if (sscanf(argv[k], "-k%d", &leaf_playouts) == 1) {
+            if (leaf_playouts < 1 || leaf_playouts > MAX_LEAF_PLAYOUTS)
+                usage();
+        }
+        else if (strncmp(argv[k], "-s", 2) == 0)
+            ;                               // board size (see main.c)
+        else if (sscanf(argv[k], "-m%d", &tt_mb) == 1) {
+            if (tt_mb < 0) usage();
+        }
+        else
+            usage();
     }
-    else
-        command = argv[1];
+    command = argv[k];
+    rng_seed(&rng, seed);
+    game_seed = seed;
+    tt_init(tt_mb);
 
     if (argc < 2)    // default action
         usage();
-    else if (strcmp(command,"gtp") == 0)
-        gtp_io();
+    else if (strcmp(command,"gtp") == 0) {
+        if (session->restart) restore_session(session);
+        start_processes();
+        next_size = gtp_io();
+        stop_processes();
+        if (next_size) save_session(session);
+    }
     else if (strcmp(command,"mcdebug") == 0)
         printf("%lf\n", mcplayout(pos, amaf_map, owner_map, 1));
     else if (strcmp(command,"mcbenchmark") == 0)
         printf("%lf\n", mcbenchmark(2000, pos, amaf_map, owner_map));
+    else if (strcmp(command,"benchmark") == 0 && k+1 < argc)
+        benchmark(argv[k+1], seed);
+    else if (strcmp(command,"selfplay") == 0 && k+2 < argc)
+        selfplay(atoi(argv[k+1]), argv[k+2]);
+    else if (strcmp(command,"compile_patterns") == 0)
+        compile_large_patterns();
     else if (strcmp(command,"tsdebug") == 0) {
-        Point move=tree_search(tree, 100, amaf_map, 0);
+        Point move=tree_search(tree, 100, 0, amaf_map, 0);
         fprintf(stderr, "move = %s\n", str_coord(move,buf));
         if (move != PASS_MOVE && move != RESIGN_MOVE)
-            play_move(&tree->pos,move);
-        print_pos(&tree->pos, stderr, NULL);
+            play_move(pos,move);
+        print_pos(pos, stderr, NULL);
     }
     else
         usage();
-    free_tree(tree); free(pos);
-    free(amaf_map); free(owner_map);
-    free(already_suggested); free(mark1); free(mark2);
-    fclose(flog);
-    return 0;
+    arena_free(&arenas[0]); arena_free(&arenas[1]); free(pos);
+    free(amaf_map); free(owner_map); tt_init(0);
+    thread_free();
+    log_close();
+    return next_size;
 }
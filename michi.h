@@ -5,16 +5,30 @@
 #include <ctype.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
 //========================= Definition of Data Structures =====================
 
 // --------------------------- Board Constants --------------------------------
-#define N         13
+// The engine is built once for each board size of BOARD_SIZES (see Makefile
+// and main.c), with N defined on the command line of the compiler
+#define BOARD_SIZES "9 13 19"
+#define IS_BOARD_SIZE(s) ((s) == 9 || (s) == 13 || (s) == 19)
+#define N_DEFAULT 13
+#ifndef N
+#define N         N_DEFAULT
+#endif
 #define W         (N+2)
 #define BOARDSIZE ((N+1)*W+1)
 #define BOARD_IMIN (N+1)
 #define BOARD_IMAX (BOARDSIZE-N-1)
 #define LARGE_BOARDSIZE ((N+14)*(N+7))
-#define BUFLEN 256
+#define BUFLEN (256+N*N)   // a gtp line can hold a position (michi-setpos)
+#define ROOT_STATS_LEN (BOARDSIZE*48) // reply of michi-root_search (+ owners)
 #define MAX_GAME_LEN (N*N*3)
 #define SINGLEPT_OK       1
 #define SINGLEPT_NOK      0
@@ -25,6 +39,9 @@
 #define N_SIMS     1400
 #define RAVE_EQUIV 3500
 #define EXPAND_VISITS 8
+#define PW_INIT      10    // progressive widening: number of children searched
+#define PW_VISITS    40    // at first, one more each time the visits of the
+#define PW_RATE      1.3   // node are multiplied by PW_RATE after PW_VISITS
 #define PRIOR_EVEN         10   // should be even number; 0.5 prior
 #define PRIOR_SELFATARI    10   // negative prior
 #define PRIOR_CAPTURE_ONE  15
@@ -41,8 +58,23 @@ extern  int PRIOR_CFG[];   // priors for moves in cfg dist. 1, 2, 3
 #define PROB_RSAREJECT 0.5 // prob of rejecting random self-atari in playout
                            // this is lower than above to allow nakade
 #define RESIGN_THRES     0.2
+#define RESIGN_MIN_SIMS  REPORT_PERIOD // no resignation after a shorter search
 #define FASTPLAY20_THRES 0.8 //if at 20% playouts winrate is >this, stop reading
 #define FASTPLAY5_THRES  0.95 //if at 5% playouts winrate is >this, stop reading
+#define MAX_THREADS      64   // maximum number of threads of the tree search
+#define MAX_LEAF_PLAYOUTS 64  // maximum #playouts run from a leaf (option -k)
+#define MAX_PROCESSES    16   // maximum number of worker processes (option -w)
+#define TT_MB            16   // default size of the transposition table (MB)
+#define MAX_SIMS       1000000 // maximum #playouts of a search limited by time
+#define MAX_TREE_NODES 4000000 // the search stops when the tree is larger
+#define TIME_MOVES_MIN   30   // min #moves for which the main time is shared
+#define TIME_MARGIN      0.5  // seconds kept to absorb the communication lag
+#define BENCH_PLAYOUTS   500  // playouts per position of "michi benchmark"
+#define BENCH_EXPANDS   2000  // expansions of the root per position
+#define BENCH_SIMS      1000  // simulations of the search per position
+#define LOG_TYPES      "EWIC" // types of messages logged by default (option -L)
+#define LOG_FLUSH_PERIOD  1   // the log file is flushed every second
+#define LOG_BUFFER_SIZE (1<<16) // size of the buffer of the log file
 
 //------------------------------- Data Structures -----------------------------
 typedef unsigned char Byte;
@@ -51,6 +83,9 @@ typedef unsigned int  Point;
 typedef unsigned long long ZobristHash;
 typedef Info* Slist;
 typedef enum {PASS_MOVE, RESIGN_MOVE, COMPUTER_BLACK, COMPUTER_WHITE} Code;
+#define BB_WORDS ((BOARDSIZE+63)/64)
+typedef struct { unsigned long long w[BB_WORDS]; } Bitboard; // bit i = point i
+typedef struct { unsigned long long s[4]; } Rng;  // random generator state
 
 typedef struct { // ---------------------- Go Position ------------------------
 // Given a board of size NxN (N=9, 19, ...), we represent the position
@@ -60,6 +95,27 @@ typedef struct { // ---------------------- Go Position ------------------------
     char  color[BOARDSIZE];   // string that hold the state of the board
     Byte  env4[BOARDSIZE];    // color encoding for the 4 neighbors
     Byte  env4d[BOARDSIZE];   // color encoding for the 4 diagonal neighbors
+    // Blocks of stones are incrementally updated by put_stone/remove_stone.
+    // A block is identified by one of its stones (its head) and its stones
+    // are linked in a circular list. The data of the block are stored at the
+    // index of the head: number of pseudo liberties (a liberty is counted once
+    // for each adjacent stone), sum and sum of squares of their coordinates.
+    // The block is in atari iff all its pseudo liberties are the same point.
+    unsigned short block[BOARDSIZE];   // head of the block (0 for EMPTY)
+    unsigned short next[BOARDSIZE];    // next stone in the block
+    unsigned short plibs[BOARDSIZE];   // number of pseudo liberties
+    unsigned int   libsum[BOARDSIZE];  // sum of pseudo liberties
+    unsigned int   libsum2[BOARDSIZE]; // sum of squares of pseudo liberties
+    // The same board as bitboards (incrementally updated as the blocks). The
+    // off board points are the points that are in none of them.
+    Bitboard bb_X, bb_x, bb_empty;     // stones of 'X', of 'x', empty points
+    Bitboard bb_pat3;                  // empty points that match a pat3 pattern
+    // And the set of the empty points as an unordered array (for the random
+    // choice of a point in O(1))
+    unsigned short empty[N*N];         // the nempty empty points
+    unsigned short empty_idx[BOARDSIZE]; // index of an empty point in empty[]
+    int   nempty;
+    ZobristHash hash;         // Zobrist signature of the stones (BLACK/WHITE)
     int   n;                  // move number
     Point ko, ko_old;         // position of the ko (0 if no ko)
     Point last, last2, last3; // position of the last move and the move before
@@ -68,6 +124,40 @@ typedef struct { // ---------------------- Go Position ------------------------
     char  capX;               // number of stones captured by the 'X' player
 } Position;         // Go position
 
+#define JOURNAL_SIZE 32768   // max number of data recorded in the journal
+#define MAX_UNDO     1024    // max number of moves that can be undone
+// Bound of the entries of one move in each stack: a stone put or removed
+// saves at most 9 data of each size (17 of 4 bytes for the stone put, with the
+// blocks of its 4 neighbors and 3 merges), a merge saves block[] once for each
+// stone of the merged block, and a move puts 1 stone and removes < N*N ones.
+#define JOURNAL_MOVE_MAX (10*N*N+20)
+typedef struct { // --------------- Journal of the changes (undo) -------------
+// While a move is played by play_move_undoable(), the routines that modify a
+// position save the old value of each data before changing it (JSAVE). The
+// move is undone by restoring these values in reverse order. swap_color() is
+// not recorded (it is its own inverse), neither are the scalar data of the
+// position and bb_pat3 (they are saved once per move).
+// The data of 1, 2, 4 and 8 bytes are recorded in 4 separate stacks (a given
+// data has always the same size, so that the order between stacks does not
+// matter) and restored by loops without tests.
+    Position      *pos;                 // position being recorded (or NULL)
+    int           n1, n2, n4, n8;       // number of entries of the stacks
+    struct {unsigned short off; Byte old;}               e1[JOURNAL_SIZE];
+    struct {unsigned short off; unsigned short old;}     e2[JOURNAL_SIZE];
+    struct {unsigned short off; unsigned int old;}       e4[JOURNAL_SIZE];
+    struct {unsigned short off; unsigned long long old;} e8[JOURNAL_SIZE];
+    int           nmoves;               // number of moves that can be undone
+    struct {
+        int       n1, n2, n4, n8;       // first entries for this move
+        Position  *prev;                // position recorded before this move
+        Point     ko, ko_old, last, last2;
+        int       n;
+        char      cap, capX;
+        ZobristHash hash;
+        Bitboard  bb_pat3;
+    } move[MAX_UNDO];
+} Journal;
+
 typedef struct tree_node { // ------------ Monte-Carlo tree node --------------
     int v;          // number of visits
     int w;          // number of wins(expected reward is w/v)
@@ -76,9 +166,40 @@ typedef struct tree_node { // ------------ Monte-Carlo tree node --------------
     int av;         // av, aw are amaf values ("all moves as first"),
     int aw;         // used for the RAVE tree policy)
     int nchildren;  // number of children
-    Position pos;
-    struct tree_node **children;
+    unsigned short move;  // move leading to this node
+    unsigned short rank;  // rank of the move by prior value (0: the best one)
+    struct tree_node *children; // array of nchildren nodes
+// The position of a node is not stored (it would take most of the memory and
+// of the cache). It is rebuilt by replaying the moves from the position at
+// the root of the tree when the tree is descended (see tree_descend()).
 } TreeNode;         //  Monte-Carlo tree node
+// The children of a node are sorted by move and their array is preceded in
+// the arena by the set of their moves (the pass move excepted)
+#define CHILD_MOVES(children)  (((Bitboard *) (children)) - 1)
+
+typedef struct { // -------------- Entry of the transposition table -----------
+// The entry is valid if check ^ data is the key of the position: an entry
+// being written by two threads at the same time is detected (lock-free table)
+    unsigned long long check;
+    unsigned long long data;      // the node of the position (TreeNode *)
+} TTEntry;
+
+#define ARENA_CHUNK  (16<<20)   // size of the memory chunks of an arena
+typedef struct chunk {
+    struct chunk *next;
+    size_t       used;            // number of bytes allocated in this chunk
+    char         mem[ARENA_CHUNK];
+} Chunk;
+
+typedef struct { // ------------- Memory arena for the tree nodes -------------
+// The nodes are allocated by bumping a pointer in big chunks of memory, so
+// that all the children of a node are contiguous. The whole tree is released
+// at once by arena_reset() and the chunks are reused for the next tree.
+    Chunk        *first, *current;
+    size_t       used;            // number of bytes allocated
+    int          nnodes;          // number of allocated nodes
+    pthread_mutex_t mutex;
+} Arena;
 
 typedef struct {
     int        value;
@@ -86,22 +207,77 @@ typedef struct {
     int        mark[BOARDSIZE];
 } Mark;
 
+typedef struct { // ------- Work arrays of a call of fix_atari() -------------
+    Point stones[BOARDSIZE], blocks[256], blibs[256];
+    Point moves[BOARDSIZE], sizes[BOARDSIZE];   // of read_ladder_attack()
+} LadderFrame;
+// Each recursion level of the ladder reading plays two stones, so the depth
+// of the calls of fix_atari() is bounded by the number of empty points
+#define MAX_LADDER_DEPTH (N*N/2+2)
+
+#define ATARI_MEMO_BITS  8
+#define ATARI_MEMO_SIZE  (1<<ATARI_MEMO_BITS)
+#define ATARI_MEMO_MOVES 6      // results with more moves are not memoized
+typedef struct { // ------- Memoized result of fix_atari() -------------------
+    ZobristHash    key;         // position, block and parameters of the call
+    char           in_atari, nmoves;
+    unsigned short moves[ATARI_MEMO_MOVES], sizes[ATARI_MEMO_MOVES];
+} AtariMemo;
+
+// Statistics of the search: calls and time (in cycles) of its phases
+typedef enum {ST_SIMUL, ST_DESCEND, ST_EXPAND, ST_PLAYOUT, ST_UPDATE,
+              ST_FIX_ATARI, ST_LADDER, ST_LARGE_PAT, ST_NPHASES} Phase;
+typedef struct {
+    unsigned long long calls[ST_NPHASES];
+    unsigned long long cycles[ST_NPHASES];
+    unsigned long long top[ST_NPHASES];   // calls that are not recursive
+    int                depth[ST_NPHASES]; // recursive calls are timed once
+    unsigned long long rejected;          // self-atari rejected in playouts
+    unsigned long long nodes;             // nodes created by expand()
+    unsigned long long transpositions;    // expand() found in the TT
+    unsigned long long atari_memo_hits;   // fix_atari() found in its memo
+    unsigned long long search_cycles;     // duration of the searches
+    double             search_time;       //    (in cycles and in seconds)
+} Stats;
+
+typedef struct { // ---- gtp session state kept when the board size changes ----
+// Each board size has its own engine with its own globals (see main.c): the
+// state set by the gtp commands is given by an engine to the next one
+    int    restart;           // 1 if the session has begun with another engine
+    int    nthreads;          // gtp threads
+    double main_time, byo_time, time_left[2];   // gtp time_settings, time_left
+    int    byo_stones, stones_left[2];
+    int    c1, c2;            // game and message counters of the log
+    unsigned int game_seed;   // seed of the next game (see begin_game())
+} Session;
+
 // -------------------------------- Global Data -------------------------------
 extern Byte bit[8];
 extern Byte pat3set[8192];
 extern int  npat3;
 extern Byte *pat3set_p[15];
-extern Mark *already_suggested, *mark1, *mark2;
-extern unsigned int idum;
+extern int  nthreads;                          // threads of the tree search
+// Data private to each thread (playouts and heuristics work areas)
+extern __thread Mark *already_suggested, *mark1, *mark2;
+extern __thread Rng  rng;                      // random generator
+extern __thread Journal *journal;
+extern __thread Stats stats;                   // counters of the thread
+extern Stats        stats_total;               // counters of ended threads
 extern FILE         *flog;                     // FILE to log messages
+extern char         *log_types;                // types of the logged messages
 extern int          c1,c2;                     // counters for messages
 
 //================================== Code =====================================
 //-------------------------- Functions in debug.c -----------------------------
+void log_open(const char *filename, int append);
+void log_close(void);
+int  log_enabled(char type);
 void log_fmt_i(char type, const char *msg, int n);
 void log_fmt_p(char type, const char *msg, Point i);
 void log_fmt_s(char type, const char *msg, const char *s);
 char* debug(Position *pos);
+char* str_stats(void);
+void  log_stats(void);
 //-------------------------- Functions in michi.c -----------------------------
 void dump_subtree(TreeNode *node,double thres,char *indent,FILE *f,int recurse);
 int fix_atari(Position *pos, Point pt, int singlept_ok
@@ -111,20 +287,34 @@ int  gen_playout_moves_capture(Position *pos, Slist heuristic_set, float prob,
 int  gen_playout_moves_pat3(Position *pos, Slist heuristic_set, float prob,
                                                                   Slist moves);
 void make_list_last_moves_neighbors(Position *pos, Slist points);
+void mcplayout_moves(Position *pos, int amaf_map[], int disp);
 double mcplayout(Position *pos, int amaf_map[], int owner_map[], int disp);
 Point parse_coord(char *s);
 char* play_move(Position *pos, Point pt);
+char* play_move_undoable(Position *pos, Point pt);
+void  undo_move(Position *pos);
+void  keep_move(Position *pos);
 char* pass_move(Position *pos);
+void  begin_game(void);
 void ppoint(Point pt);
 void print_pos(Position *pos, FILE *f, int *owner_map);
 void print_tree_summary(TreeNode *tree, int sims, FILE *f);
+void stats_add(Stats *sum, Stats *st);
+extern Arena *tree_arena;
+void thread_init(Rng *r);
+void rng_seed(Rng *r, unsigned long long seed);
+void rng_jump(Rng *r);
+void thread_free(void);
 char* slist_str_as_point(Slist l);
 char* str_coord(Point pt, char str[5]);
 //------------------------- Functions in patterns.c ---------------------------
 void   make_pat3set(void);
 char*  make_list_pat3_matching(Position *pos, Point pt);
 char*  make_list_pat_matching(Point pt, int verbose);
+int    large_pattern_ids(Point pt, int ids[12]);
 void   init_large_patterns(void);
+int    compile_large_patterns(void);
+void   init_large_board(void);
 void   copy_to_large_board(Position *pos);
 void   log_hashtable_synthesis();
 double large_pattern_probability(Point pt);
@@ -143,18 +333,80 @@ double large_pattern_probability(Point pt);
     for(int _k=1,_n=l[0],item=l[1] ; _k<=_n ; item=l[++_k])
 #define SWAP_CASE(c) {if(c == 'X') c = 'x'; else if (c == 'x') c = 'X'; }
 #define SWAP(T, u, v) {T _t = u; u = v; v = _t;}
+// Record the old value of data x of pos if pos is recorded in the journal
+#define JSAVE(pos, x) do { \
+    if ((pos) == journal->pos) journal_save(pos, &(x), sizeof(x)); } while(0)
 // Random shuffle: Knuth. The Art of Computer Programming vol.2, 2nd Ed, p.139
 #define SHUFFLE(T, l, n) for(int _k=n-1 ; _k>0 ; _k--) {  \
     int _tmp=random_int(_k); SWAP(T, l[_k], l[_tmp]); \
 }
+// Debug message of the log (type D, printf-like arguments). Compile with
+// -DNO_DEBUG_LOG to remove them.
+#ifdef NO_DEBUG_LOG
+#define LOG_DEBUG(...) do {} while(0)
+#else
+#define LOG_DEBUG(...) do { if (log_enabled('D')) { char _s[256]; \
+    snprintf(_s, sizeof(_s), __VA_ARGS__); log_fmt_s('D', "%s", _s); } \
+} while(0)
+#endif
+// Count the calls and the cycles of a phase of the search (in the statistics of
+// the thread). Compile with -DNO_STATS to remove these counters.
+// The phases called millions of times (fix_atari ...) would be slowed down by
+// the cycle counter: only 1 of STATS_SAMPLING calls is timed (STATS_SAMPLED)
+#define STATS_SAMPLING 16
+#ifndef NO_STATS
+#define STATS_TIMED(ph, nsamp) unsigned long long _t0_##ph = \
+    (stats.depth[ph]++ == 0 && stats.top[ph]++ % (nsamp) == 0) ? \
+    read_cycles() : 0
+#define STATS_STOP_TIMED(ph, nsamp) do { stats.calls[ph]++; \
+    if (--stats.depth[ph] == 0 && _t0_##ph != 0) \
+        stats.cycles[ph] += (read_cycles()-_t0_##ph) * (nsamp); \
+    } while(0)
+#define STATS_INC(field, k) (stats.field += (k))
+#else
+#define STATS_TIMED(ph, nsamp)
+#define STATS_STOP_TIMED(ph, nsamp)
+#define STATS_INC(field, k)
+#endif
+#define STATS_START(ph)         STATS_TIMED(ph, 1)
+#define STATS_STOP(ph)          STATS_STOP_TIMED(ph, 1)
+#define STATS_START_SAMPLED(ph) STATS_TIMED(ph, STATS_SAMPLING)
+#define STATS_STOP_SAMPLED(ph)  STATS_STOP_TIMED(ph, STATS_SAMPLING)
 
 //------------ Useful utility functions (inlined for performance) -------------
-// Quick and Dirty random generator (32 bits Linear Congruential Generator)
-// Ref: Numerical Recipes in C (W.H. Press & al), 2nd Ed page 284
-__INLINE__ unsigned int qdrandom(void) {idum=(1664525*idum)+1013904223; return idum;}
+// Random generator xoshiro256+ (D. Blackman & S. Vigna), each thread has its
+// own state (rng). Its low bits are weak: qdrandom() returns the 32 high bits.
+// splitmix64 fills the states from a seed (and is a generator by itself).
+__INLINE__ unsigned long long splitmix64(unsigned long long *x)
+{
+    unsigned long long z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+    return z ^ (z>>31);
+}
+__INLINE__ unsigned long long rng_next(Rng *r)
+{
+    unsigned long long *s = r->s, result = s[0] + s[3], t = s[1] << 17;
+    s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+    s[2] ^= t;    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+__INLINE__ unsigned int qdrandom(void) {return rng_next(&rng) >> 32;}
 __INLINE__ unsigned int random_int(int n) /* random int between 0 and n-1 */ \
            {unsigned long long r=qdrandom(); return (r*n)>>32;}
 
+// Cycle counter (time stamp counter of x86, nanoseconds elsewhere)
+#if defined(__x86_64__) || defined(__i386__)
+__INLINE__ unsigned long long read_cycles(void) {return __rdtsc();}
+#else
+__INLINE__ unsigned long long read_cycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+#endif
+
 // Go programs manipulates lists or sets of (small) integers a lot. There are
 // many possible implementations that differ by the performance of the various
 // operations we need to perform on these data structures.
@@ -174,6 +426,8 @@ __INLINE__ unsigned int random_int(int n) /* random int between 0 and n-1 */ \
 // of brevity that is a priority for michi (actually the code is very short).
 //
 // Note: the pat3_set in patterns.c is a representation of a set as bitfield.
+// The Bitboard is another one, for sets of points, that are manipulated as a
+// whole with word-parallel operations (see the board routines in michi.c).
 
 __INLINE__ int  slist_size(Slist l) {return l[0];}
 __INLINE__ void slist_clear(Slist l) {l[0]=0;}
@@ -205,6 +459,54 @@ __INLINE__ void mark_release(Mark *m) {m->in_use = 0;}   // for debugging
 __INLINE__ void mark(Mark *m, Info i) {m->mark[i] = m->value;}
 __INLINE__ int  is_marked(Mark *m, Info i) {return m->mark[i] == m->value;}
 
+// Bitboards
+__INLINE__ void bb_set(Bitboard *b, Point pt) {b->w[pt>>6] |= 1ULL<<(pt&63);}
+__INLINE__ void bb_clear(Bitboard *b, Point pt)
+        {b->w[pt>>6] &= ~(1ULL<<(pt&63));}
+__INLINE__ int  bb_is_set(Bitboard *b, Point pt)
+        {return (b->w[pt>>6] >> (pt&63)) & 1;}
+__INLINE__ int  bb_count(Bitboard *b)
+{
+    int n=0;
+    for (int k=0 ; k<BB_WORDS ; k++) n += __builtin_popcountll(b->w[k]);
+    return n;
+}
+__INLINE__ Bitboard bb_shift_up(Bitboard b, int s)      // bit i -> bit i+s
+{
+    for (int k=BB_WORDS-1 ; k>0 ; k--)
+        b.w[k] = (b.w[k] << s) | (b.w[k-1] >> (64-s));
+    b.w[0] <<= s;
+    return b;
+}
+__INLINE__ Bitboard bb_shift_down(Bitboard b, int s)    // bit i -> bit i-s
+{
+    for (int k=0 ; k<BB_WORDS-1 ; k++)
+        b.w[k] = (b.w[k] >> s) | (b.w[k+1] << (64-s));
+    b.w[BB_WORDS-1] >>= s;
+    return b;
+}
+
+// Journal of the changes of a position (see play_move_undoable())
+__INLINE__ void journal_save(Position *pos, void *data, int size)
+{
+    // size is a constant: the switch is resolved at compile time
+    int off = (char *) data - (char *) pos, n;
+    switch (size) {
+        case 1:  n = journal->n1++; assert(n < JOURNAL_SIZE);
+                 journal->e1[n].off = off;
+                 journal->e1[n].old = *(Byte *) data; break;
+        case 2:  n = journal->n2++; assert(n < JOURNAL_SIZE);
+                 journal->e2[n].off = off;
+                 journal->e2[n].old = *(unsigned short *) data; break;
+        case 4:  n = journal->n4++; assert(n < JOURNAL_SIZE);
+                 journal->e4[n].off = off;
+                 journal->e4[n].old = *(unsigned int *) data; break;
+        default: n = journal->n8++; assert(n < JOURNAL_SIZE);
+                 journal->e8[n].off = off;
+                 journal->e8[n].old = *(unsigned long long *) data;
+    }
+}
+
 // Pattern matching
 __INLINE__ int pat3_match(Position *pos, Point pt)
 {
@@ -2,6 +2,10 @@
 //
 // (c) 2015 Denis Blumstein <db3108@free.fr> Petr Baudis <pasky@ucw.cz>
 // MIT licence (i.e. almost public domain)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "michi.h"
 
 // There are two types of patterns used in michi :
@@ -294,10 +298,19 @@ void make_pat3set(void)
 // array which stores the displacements with respect to the central point.
 //
 // The hash table "patterns" is computed by init_patterns().
-// It uses internal chaining with double hashing [9].
+// It uses open addressing with linear probing [9]: the table size is a power of
+// 2 which is doubled during the loading when it becomes half full, so it is
+// sized to the number of patterns and a search usually reads one cache line.
 // The performance of this hash table is reported in the log file michi.log
 // after the compilation of patterns.spat file and at the end of the execution.
 //
+// Reading the text files is slow and the table is big. So the table can be
+// saved in a binary file (command "michi compile_patterns") which is then
+// mapped read-only in memory at startup (fast, and the memory is shared by
+// all the michi processes of the computer). The file begins with a header
+// that identifies its format and contains the Zobrist data used to compute
+// the keys. It is used only if it is more recent than the text files.
+//
 // ------------------------ Data Structures -----------------------------------
 // Large pattern entry in the hash table
 typedef struct hash_t {
@@ -305,10 +318,23 @@ typedef struct hash_t {
     int           id;       // id of the pattern
     float         prob;     // probability of move triggered by the pattern
 } LargePat;
-#define KSIZE      25         // key size in bits
-#define LENGTH     (1<<KSIZE) // Size of the hash table
-#define KMASK      (LENGTH-1) // Mask to get the key from the hash signature
+#define MIN_LENGTH (1<<10)    // Initial size of the hash table
+// Index of a key in the hash table (Fibonacci hashing: the bits of the keys
+// built with a LCG are too regular to be used directly with linear probing)
+#define PAT_INDEX(key) ((int) (((key) * 0x9E3779B97F4A7C15ULL) >> pat_kshift))
 #define FOUND      -1
+#define PATTERNS_BIN     "patterns.bin"
+#define PATTERNS_VERSION 2
+
+// Header of the binary pattern file (followed by the hash table)
+typedef struct {
+    char          magic[8];         // "MICHIPAT"
+    int           version;          // PATTERNS_VERSION
+    int           npats;            // number of patterns read in patterns.spat
+    long long     length;           // number of entries of the hash table
+    long long     nkeys;            // number of used entries
+    ZobristHash   zobrist[141][4];  // to compute the keys (zobrist_hashdata)
+} PatFileHeader;
 
 // Displacements with respect to the central point
 typedef struct shift_t { int x, y; } Shift;
@@ -340,26 +366,34 @@ Shift pat_gridcular_seq[] = {
 int pat_gridcular_seq1d[141];
 int pat_gridcular_size[13] = {0,9,13,21,29,37,49,61,73,89,105,121,141};
 int large_patterns_loaded = 0;
-// Primes used for double hashing in find_pat()
-int primes[32]={5,      11,    37,   103,   293,   991, 2903,  9931,
-                7,      19,    73, 10009, 11149, 12553, 6229, 10181,
-                1013, 1583,  2503,  3491,  4637,  5501, 6571,  7459,
-                8513, 9433, 10433, 11447, 11887, 12409, 2221,  4073};
 
-static char buf[512];
+static __thread char buf[512];
 int         color[256];
 ZobristHash zobrist_hashdata[141][4];
 LargePat*   patterns;
+int         pat_length=0;          // size of the hash table (power of 2)
+int         pat_kmask=0;           // mask of the index in the hash table
+int         pat_kshift=64;         // shift to get the index from the key
+long long   nkeys=0;               // number of keys in the hash table
+int         npats=0;               // number of patterns read
 float*      probs;
+// Note: the statistics are only approximate when the search uses threads
 long long   nsearchs=0;
 long long   nsuccess=0;
 double      sum_len_success=0;
 double      sum_len_failure=0;
 
-char large_board[LARGE_BOARDSIZE];
+__thread char large_board[LARGE_BOARDSIZE]; // one per thread (see expand())
+// Zobrist signatures of the ring of size s (points of the pattern of size s
+// that are not in the pattern of size s-1) around each point of large_board,
+// for BLACK to play [0] and for WHITE to play [1]
+__thread ZobristHash large_hash[2][LARGE_BOARDSIZE][12];
+__thread int large_parity;   // move number parity of the last copied position
 int  large_coord[BOARDSIZE]; // coord in the large board of any points of board
+int  pat_gridcular_ring[141];// ring (size-1) containing the gridcular point i
+int  swapped_color[4] = {0, 1, 3, 2};  // color[] seen by the other player
 
-// Code: ------ Dictionnary of patterns (hastable with internal chaining) -----
+// Code: ------ Dictionnary of patterns (hastable with linear probing) -------
 void print_pattern(const char *msg, int i, LargePat p)
 {
     sprintf(buf,"%s%-6d %16.16llx %6d %f", msg, i, p.key, p.id, p.prob);
@@ -368,7 +402,7 @@ void print_pattern(const char *msg, int i, LargePat p)
 void dump_patterns()
 {
     printf("Large patterns hash table\n");
-    for (int i=0 ; i<LENGTH ; i++) {
+    for (int i=0 ; i<pat_length ; i++) {
         print_pattern("", i, patterns[i]);
         printf("%s\n", buf);
     }
@@ -378,26 +412,47 @@ int find_pat(ZobristHash key)
 {
     assert(key!=0);
 
-    int h = (key>>20) & KMASK, h2=primes[(key>>(20+KSIZE)) & 15], len=1;
+    int h = PAT_INDEX(key), len=1;
     nsearchs++;
     while (patterns[h].key != key) {
-        len++;
         if (patterns[h].key == 0) {
             sum_len_failure += len;
             return h;
         }
-        h+=h2; if (h>LENGTH) h -= LENGTH;
+        len++;
+        h = (h+1) & pat_kmask;
     }
     nsuccess++;
     sum_len_success += len;
     return h;
 }
 
+void alloc_patterns(int new_length)
+// (Re)allocate the hash table with new_length entries and reinsert the keys
+{
+    LargePat *old = patterns;
+    int old_length = pat_length;
+    patterns = calloc(new_length, sizeof(LargePat));
+    pat_length = new_length;
+    pat_kmask = pat_length-1;
+    for (pat_kshift=64 ; (1<<(64-pat_kshift)) < pat_length ; pat_kshift--);
+    for (int i=0 ; i<old_length ; i++) {
+        if (old[i].key == 0) continue;
+        int h = PAT_INDEX(old[i].key);
+        while (patterns[h].key != 0) h = (h+1) & pat_kmask;
+        patterns[h] = old[i];
+    }
+    free(old);
+}
+
 int insert_pat(LargePat p)
 {
+    if (2*(nkeys+1) > pat_length)    // keep the fill ratio below 50 %
+        alloc_patterns(2*pat_length);
     int i = find_pat(p.key);
     if (patterns[i].key==0) {
         patterns[i] = p;
+        nkeys++;
         return i;
     }
     else
@@ -421,10 +476,15 @@ void init_stone_color(void)
 }
 
 void init_zobrist_hashdata(void)
+// The keys are drawn with the Linear Congruential Generator of michi (Ref:
+// Numerical Recipes in C, 2nd Ed page 284) from a fixed seed, they do not
+// depend on the random generator of the search
 {
+    unsigned int idum = 1;
     for (int d=0 ; d<141 ; d++)  {//d = displacement ...
         for (int c=0 ; c<4 ; c++) {
-            unsigned int d1 = qdrandom(), d2=qdrandom();
+            unsigned int d1 = (idum = 1664525*idum + 1013904223);
+            unsigned int d2 = (idum = 1664525*idum + 1013904223);
             ZobristHash ld1 = d1, ld2=d2;
             zobrist_hashdata[d][c] = (ld1<<32) + ld2;
         }
@@ -440,13 +500,15 @@ ZobristHash zobrist_hash(char *pat) {
     return k;
 }
 
-ZobristHash
-update_zobrist_hash_at_point(Point pt, int size, ZobristHash k)
-// Update the Zobrist signature for the points of pattern of size 'size'
+ZobristHash ring_hash(int lpt, int size, int parity)
+// Compute the Zobrist signature of the ring of size 'size' around the point
+// lpt of the large board (parity=1: the colors are seen by WHITE)
 {
+    ZobristHash k=0;
     int imin=pat_gridcular_size[size-1], imax=pat_gridcular_size[size];
     for (int i=imin ; i<imax ; i++) {
-        int c = color[large_board[pt+pat_gridcular_seq1d[i]]];
+        int c = color[large_board[lpt+pat_gridcular_seq1d[i]]];
+        if (parity) c = swapped_color[c];
         k ^= zobrist_hashdata[i][c];
     }
     return k;
@@ -458,6 +520,13 @@ void init_gridcular(Shift seq[141], int seq1d[141]) {
         seq1d[i] = seq[i].x - seq[i].y*(N+7);
 }
 
+void init_gridcular_ring(void)
+{
+    for (int s=1 ; s<13 ; s++)
+        for (int i=pat_gridcular_size[s-1] ; i<pat_gridcular_size[s] ; i++)
+            pat_gridcular_ring[i] = s-1;
+}
+
 int nperms=0;       // current permutation
 
 int permutation_OK(int p[8][141])
@@ -542,8 +611,8 @@ int max_pattern_id(FILE *f)
         if (id>id_max)
             id_max = id;
     }
-    return id_max;
     rewind(f);
+    return id_max;
 }
 
 void load_prob_file(FILE *f)
@@ -560,7 +629,7 @@ void load_prob_file(FILE *f)
 
 int load_spat_file(FILE *f)
 {
-    int  d, id, idmax=-1, len, lenmax=0, npats=0;
+    int  d, id, idmax=-1, len, lenmax=0;
     char strpat[256], strperm[256];
     ZobristHash k;
     int permutation[8][141];
@@ -596,8 +665,83 @@ int load_spat_file(FILE *f)
     return npats;
 }
 
+// Code: ----------------------- binary pattern file --------------------------
+int is_older(struct stat *st, const char *filename)
+// Return 1 if the file described by st is older than file filename
+{
+    struct stat st2;
+    return stat(filename, &st2) == 0 && st2.st_mtime > st->st_mtime;
+}
+
+int map_patterns_file(const char *filename)
+// Map the hash table of the binary pattern file in memory (read only)
+// Return 1 if successful, 0 if the file is missing, out of date or invalid
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || is_older(&st, "patterns.spat")
+                            || is_older(&st, "patterns.prob")) {
+        log_fmt_s('W', "%s is out of date (ignored)", filename);
+        close(fd);
+        return 0;
+    }
+    PatFileHeader *h = NULL;
+    if (st.st_size >= sizeof(PatFileHeader))
+        h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == NULL || h == MAP_FAILED) return 0;
+    if (memcmp(h->magic, "MICHIPAT", 8) != 0 || h->version != PATTERNS_VERSION
+            || h->length <= 0 || (h->length & (h->length-1)) != 0
+            || st.st_size != sizeof(PatFileHeader)+h->length*sizeof(LargePat)) {
+        log_fmt_s('W', "%s has not the expected format (ignored)", filename);
+        munmap(h, st.st_size);
+        return 0;
+    }
+    memcpy(zobrist_hashdata, h->zobrist, sizeof(zobrist_hashdata));
+    patterns = (LargePat *) (h+1);
+    pat_length = h->length;
+    pat_kmask = pat_length-1;
+    for (pat_kshift=64 ; (1<<(64-pat_kshift)) < pat_length ; pat_kshift--);
+    nkeys = h->nkeys;
+    npats = h->npats;
+    large_patterns_loaded = 1;
+    log_fmt_s('I', "large patterns mapped from %s", filename);
+    return 1;
+}
+
+int save_patterns_file(const char *filename)
+// Write the hash table in a binary pattern file, return 1 if successful.
+// The file is written under a temporary name, then renamed, so that running
+// michi processes always see a complete file.
+{
+    PatFileHeader h;
+    char tmpname[256];
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MICHIPAT", 8);
+    h.version = PATTERNS_VERSION;
+    h.npats = npats;
+    h.length = pat_length;
+    h.nkeys = nkeys;
+    memcpy(h.zobrist, zobrist_hashdata, sizeof(zobrist_hashdata));
+
+    sprintf(tmpname, "%s.tmp", filename);
+    FILE *f = fopen(tmpname, "wb");
+    if (f == NULL) return 0;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+          && fwrite(patterns, sizeof(LargePat), pat_length, f) == pat_length;
+    ok = (fclose(f) == 0) && ok;
+    if (ok) ok = (rename(tmpname, filename) == 0);
+    if (!ok) remove(tmpname);
+    return ok;
+}
+
 // Code: --------------------------- Large Board ------------------------------
 // Large board with border of width 7 (to easily compute neighborhood of points)
+// Its stones are seen by BLACK ('X' is BLACK) whatever the player to move.
+// copy_to_large_board() changes only the points that differ from the position
+// and updates the signatures of the rings which contain these points, so most
+// of large_pattern_probability() is reading the ring signatures of a point.
 
 void compute_large_coord(void)
 // Compute the position in the large board of any point on the board
@@ -612,17 +756,59 @@ void compute_large_coord(void)
 }
 
 void init_large_board(void)
+// Initialize the large board of the current thread (empty board with a border
+// of OUT points) and the ring signatures of its points
 {
     memset(large_board, '#', LARGE_BOARDSIZE);
-    compute_large_coord();
+    memset(large_hash, 0, sizeof(large_hash));
+    for (int y=0 ; y<N ; y++)
+       for (int x=0 ; x<N ; x++)
+           large_board[(y+7)*(N+7) + x+7] = '.';
+    for (int y=0 ; y<N ; y++)
+       for (int x=0 ; x<N ; x++) {
+           int lpt = (y+7)*(N+7) + x+7;
+           for (int s=1 ; s<13 ; s++) {
+               large_hash[0][lpt][s-1] = ring_hash(lpt, s, 0);
+               large_hash[1][lpt][s-1] = ring_hash(lpt, s, 1);
+           }
+       }
+    large_parity = 0;
+}
+
+void large_board_set(int lpt, char c)
+// Put c at the point lpt of the large board and update the signatures of the
+// rings that contain this point
+{
+    int c0 = color[large_board[lpt]], c1 = color[c];
+    int d0 = swapped_color[c0], d1 = swapped_color[c1];
+    large_board[lpt] = c;
+    for (int i=0 ; i<141 ; i++) {
+        int pt = lpt - pat_gridcular_seq1d[i], s = pat_gridcular_ring[i];
+        large_hash[0][pt][s] ^= zobrist_hashdata[i][c0] ^ zobrist_hashdata[i][c1];
+        large_hash[1][pt][s] ^= zobrist_hashdata[i][d0] ^ zobrist_hashdata[i][d1];
+    }
+}
+
+char large_color(Position *pos, Point pt)
+// Color of the point pt seen by BLACK
+{
+    char c = pos->color[pt];
+    if ((pos->n & 1) && (c == 'X' || c == 'x'))
+        c ^= 'X' ^ 'x';
+    return c;
 }
 
 int large_board_OK(Position *pos)
 {
     FORALL_POINTS(pos,pt) {
         if (pos->color[pt] == ' ') continue;
-        if (pos->color[pt] != large_board[large_coord[pt]])
+        int lpt = large_coord[pt];
+        if (large_color(pos, pt) != large_board[lpt])
             return 0;
+        for (int s=1 ; s<13 ; s++)
+            if (large_hash[0][lpt][s-1] != ring_hash(lpt, s, 0)
+                    || large_hash[1][lpt][s-1] != ring_hash(lpt, s, 1))
+                return 0;
     }
     return 1;
 }
@@ -640,12 +826,16 @@ void print_large_board(FILE *f)
 }
 
 void copy_to_large_board(Position *pos)
-// Copy the current position to the large board
+// Copy the current position to the large board (only the points that changed)
 {
     int lpt=(N+7)*7+7, pt=(N+1)+1;
+    large_parity = pos->n & 1;
     for (int y=0 ; y<N ; y++, lpt+=7, pt++)
-       for (int x=0 ; x<N ; x++)
-           large_board[lpt++] = pos->color[pt++];
+       for (int x=0 ; x<N ; x++, lpt++, pt++) {
+           char c = large_color(pos, pt);
+           if (c != large_board[lpt])
+               large_board_set(lpt, c);
+       }
     assert(large_board_OK(pos));
 }
 
@@ -655,14 +845,22 @@ void init_large_patterns(void)
 {
     FILE *fspat, *fprob;    // Files containing large patterns
 
+    if (patterns != NULL) return;   // engine restarted (see michi_console())
     // Initializations
     init_zobrist_hashdata();
     init_stone_color();
     init_gridcular(pat_gridcular_seq, pat_gridcular_seq1d);
-    init_large_board();
+    init_gridcular_ring();
+    compute_large_coord();
+
+    // Map the compiled patterns if possible
+    if (map_patterns_file(PATTERNS_BIN)) {
+        log_hashtable_synthesis();
+        return;
+    }
 
     // Load patterns data from files
-    patterns = calloc(LENGTH, sizeof(LargePat));
+    alloc_patterns(MIN_LENGTH);
     log_fmt_s('I', "Loading pattern probs ...", NULL);
     fprob = fopen("patterns.prob", "r");
     if (fprob == NULL)
@@ -683,6 +881,7 @@ void init_large_patterns(void)
             load_spat_file(fspat);
             fclose(fspat);
         }
+        free(probs);
     }
     if (fprob == NULL || fspat == NULL) {
         fprintf(stderr, "Warning: michi cannot load pattern files, "
@@ -697,6 +896,22 @@ void init_large_patterns(void)
     sum_len_success=sum_len_failure=0.0;
 }
 
+int compile_large_patterns(void)
+// Command "compile_patterns": save the patterns in the binary file
+{
+    if (!large_patterns_loaded) {
+        fprintf(stderr, "No large patterns loaded\n");
+        return -1;
+    }
+    if (!save_patterns_file(PATTERNS_BIN)) {
+        fprintf(stderr, "Cannot write %s\n", PATTERNS_BIN);
+        return -1;
+    }
+    fprintf(stderr, "%d patterns (%lld keys) saved in %s\n", npats, nkeys,
+                                                                 PATTERNS_BIN);
+    return 0;
+}
+
 double large_pattern_probability(Point pt)
 // return probability of large-scale pattern at coordinate pt.
 // Multiple progressively wider patterns may match a single coordinate,
@@ -704,12 +919,13 @@ double large_pattern_probability(Point pt)
 {
     double prob=-1.0;
     int matched_len=0, non_matched_len=0;
-    ZobristHash k=0;
+    ZobristHash k=0, *ring=large_hash[large_parity][large_coord[pt]];
 
+    STATS_START_SAMPLED(ST_LARGE_PAT);
     if (large_patterns_loaded)
         for (int s=1 ; s<13 ; s++) {
             int len = pat_gridcular_size[s];
-            k = update_zobrist_hash_at_point(large_coord[pt], s, k);
+            k ^= ring[s-1];
             int i = find_pat(k);
             if (patterns[i].key==k) {
                 prob = patterns[i].prob;
@@ -720,40 +936,58 @@ double large_pattern_probability(Point pt)
             else
                 non_matched_len = len;
         }
+    STATS_STOP_SAMPLED(ST_LARGE_PAT);
     return prob;
 }
 
+int list_pat_matching(Point pt, int ids[12])
+// Store the indices in patterns[] of the patterns that match at the point pt
+// (from the smallest to the largest) in ids, return their number
+{
+    ZobristHash k=0, *ring=large_hash[large_parity][large_coord[pt]];
+    int i, n=0;
+
+    if (!large_patterns_loaded) return 0;
+    for (int s=1 ; s<13 ; s++) {
+        k ^= ring[s-1];
+        i = find_pat(k);
+        if (patterns[i].key == k) ids[n++] = i;
+    }
+    return n;
+}
+
+int large_pattern_ids(Point pt, int ids[12])
+// Store the ids of the patterns that match at the point pt in ids (the ids of
+// patterns.spat), return their number
+{
+    int n = list_pat_matching(pt, ids);
+    for (int k=0 ; k<n ; k++) ids[k] = patterns[ids[k]].id;
+    return n;
+}
+
 char* make_list_pat_matching(Point pt, int verbose)
 // Build the list of patterns that match at the point pt
 {
-    ZobristHash k=0;
-    int i;
+    int  ids[12], n=list_pat_matching(pt, ids);
     char id[16];
 
-    if (!large_patterns_loaded) return "";
-
     buf[0] = 0;
-    for (int s=1 ; s<13 ; s++) {
-        k = update_zobrist_hash_at_point(large_coord[pt], s, k);
-        i = find_pat(k);
-        if (patterns[i].key == k) {
-            if (verbose)
-                sprintf(id,"%d(%.3f) ", patterns[i].id, patterns[i].prob);
-            else
-                sprintf(id,"%d ", patterns[i].id);
-            strcat(buf, id);
-        }
+    for (int k=0 ; k<n ; k++) {
+        LargePat *p = &patterns[ids[k]];
+        if (verbose) sprintf(id,"%d(%.3f) ", p->id, p->prob);
+        else         sprintf(id,"%d ", p->id);
+        strcat(buf, id);
     }
     return buf;
 }
 
 void log_hashtable_synthesis()
 {
-    double nkeys=0;
-    for (int i=0 ; i<LENGTH ; i++)
-        if(patterns[i].key != 0) nkeys +=1.0;
-    sprintf(buf,"hashtable entries: %.0lf (fill ratio: %.1lf %%)", nkeys,
-                                             100.0 * nkeys / LENGTH);
+    sprintf(buf,"hashtable entries: %lld (fill ratio: %.1lf %%)", nkeys,
+                                             100.0 * nkeys / pat_length);
+    log_fmt_s('I', buf, NULL);
+    sprintf(buf,"hashtable size: %d entries (%.1lf MB)", pat_length,
+                                    pat_length * sizeof(LargePat) / 1048576.0);
     log_fmt_s('I', buf, NULL);
     sprintf(buf,"%lld searches, %lld success (%.1lf %%)", nsearchs, nsuccess,
                                         100.0 * (double) nsuccess / nsearchs);
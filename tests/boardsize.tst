@@ -0,0 +1,48 @@
+#--------------------------------------------------------
+# tests of the change of board size (gtp command boardsize)
+#--------------------------------------------------------
+
+# 9x9
+# ---
+boardsize 9
+clear_board
+10 play b J9
+#? []
+
+20 genmove w
+#? [[A-HJ][1-9]]
+
+30 play w J9
+#? [?.*not EMPTY.*]
+
+# 19x19
+# -----
+boardsize 19
+clear_board
+110 play b T19
+#? []
+
+120 genmove w
+#? [[A-HJ-T]([1-9]|1[0-9])]
+
+130 play w T19
+#? [?.*not EMPTY.*]
+
+# back to the default size (13x13)
+# --------------------------------
+boardsize 13
+clear_board
+210 play b N13
+#? []
+
+220 genmove w
+#? [[A-HJ-N]([1-9]|1[0-3])]
+
+230 play w N13
+#? [?.*not EMPTY.*]
+
+240 boardsize 7
+#? [?.*incompatible boardsize.*]
+
+250 genmove b
+#? [[A-HJ-N]([1-9]|1[0-3])]
@@ -0,0 +1,69 @@
+#---------------------------------------------------------------
+# tests of the gtp commands on the ownership statistics of michi
+#---------------------------------------------------------------
+
+# no search yet
+# -------------
+boardsize 9
+clear_board
+10 final_score
+#? [?.*genmove first.*]
+
+20 final_status_list dead
+#? [?.*genmove first.*]
+
+30 michi-ownership
+#? [?.*genmove first.*]
+
+40 michi-criticality
+#? [?.*genmove first.*]
+
+50 final_status_list foo
+#? [?.*alive, dead or seki.*]
+
+60 gogui-analyze_commands
+#? [dboard/Ownership/michi-ownership\ndboard/Criticality/michi-criticality\n.*final_score\n.*final_status_list dead]
+
+# WHITE is far ahead, the BLACK stone D4 is dead
+# ---------------------------------------------
+play b pass
+play w E5
+play b pass
+play w C3
+play b pass
+play w G3
+play b pass
+play w C7
+play b pass
+play w G7
+play b D4
+play w C4
+play b pass
+play w E4
+play b pass
+play w D5
+genmove b
+
+110 final_score
+#? [W\+[0-9]+\.[0-9]]
+
+120 final_status_list dead
+#? [D4]
+
+130 final_status_list alive
+#? [C7 G7 D5 E5 C4 E4 C3 G3]
+
+140 final_status_list seki
+#? []
+
+150 michi-ownership
+#? [(-?[01]\.[0-9][0-9]( -?[01]\.[0-9][0-9]){8}\n){8}-?[01]\.[0-9][0-9]( -?[01]\.[0-9][0-9]){8}]
+
+160 michi-criticality
+#? [(-?[01]\.[0-9][0-9]( -?[01]\.[0-9][0-9]){8}\n){8}-?[01]\.[0-9][0-9]( -?[01]\.[0-9][0-9]){8}]
+
+# a new game has no statistics
+# ----------------------------
+clear_board
+210 final_score
+#? [?.*genmove first.*]